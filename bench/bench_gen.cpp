@@ -0,0 +1,48 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+// Write a synthetic, indexed BAM or CRAM (by extension) of read pairs
+// over a random reference, for benchmarking. Prints what was written
+// as one JSON object:
+//   {"bench":"synth","reads":N,"contig_len":L,...}
+//
+// usage: bench-gen <out.bam|out.cram> [key=value...]
+//   keys: contig_len n_contigs depth read_len indel_rate
+//         overlap_fraction error_rate seed
+// The reference is written to <out>.fa
+
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "synth.hpp"
+
+int main (int argc,
+          char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: bench-gen <out.bam|out.cram> "
+                     "[key=value...]"
+                  << std::endl;
+        return 1;
+    }
+    std::string out = argv[1];
+    synth_params p;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            if (!synth_param_set (p, argv[i]))
+                throw std::invalid_argument (
+                    std::string ("unknown parameter ") + argv[i]);
+        }
+        size_t n = write_synthetic (out, out + ".fa", p);
+        std::printf ("{\"bench\":\"synth\",\"reads\":%zu,%s}\n", n,
+                     synth_params_json (p).c_str());
+    } catch (std::exception &e) {
+        std::cerr << "Error generating alignments: " << e.what()
+                  << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,250 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+// Micro-benchmarks of the counting stages, and of count() end to end,
+// over synthetic alignments written to <work_dir> (see synth.hpp).
+// Prints one JSON object per line, the first describing the data:
+//   {"bench":"synth","reads":N,"contig_len":L,...}
+//   {"bench":NAME,"reps":R,"ops":N,"seconds":S,"ns_per_op":T}
+// seconds is the best of reps; an op is one (read, column) for the
+// stages and one position for count()
+//
+// usage: bench-micro <work_dir> [reps=5] [key=value...]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "aln.hpp"
+#include "count.hpp"
+#include "pileup.hpp"
+#include "point.hpp"
+#include "synth.hpp"
+
+// results land here so the timed loops cannot be optimised away
+static volatile uint64_t g_sink;
+
+template <typename F>
+static void report (const char *name,
+                    int reps,
+                    size_t ops,
+                    F &&fn) {
+    double best = -1;
+    for (int r = 0; r < reps; ++r) {
+        auto t0 = std::chrono::steady_clock::now();
+        fn();
+        auto t1 = std::chrono::steady_clock::now();
+        double s = std::chrono::duration<double> (t1 - t0).count();
+        best = best < 0 ? s : std::min (best, s);
+    }
+    std::printf ("{\"bench\":\"%s\",\"reps\":%d,\"ops\":%zu,"
+                 "\"seconds\":%.6f,\"ns_per_op\":%.3f}\n",
+                 name, reps, ops, best,
+                 ops ? best * 1e9 / static_cast<double> (ops) : 0.0);
+}
+
+// the columns of [start, end) held in memory, as the pileup would
+// hand them to the counter
+struct held_columns {
+    ReadMetaCache reads;
+    std::vector<ReadMeta *> metas;
+    std::vector<std::vector<bam_pileup1_t>> cols;
+    size_t n_entries = 0;
+
+    held_columns (const std::vector<bam_ptr> &recs,
+                  int64_t start,
+                  int64_t end,
+                  bool pair_mates)
+        : reads (pair_mates) {
+        for (const bam_ptr &b : recs)
+            metas.push_back (reads.acquire (b.get()));
+        for (int64_t pos = start; pos < end; ++pos) {
+            cols.emplace_back();
+            for (size_t i = 0; i < recs.size(); ++i) {
+                bam_pileup1_t p{};
+                if (!resolve_at (recs[i].get(), pos, p))
+                    continue;
+                p.b = recs[i].get();
+                p.cd.p = metas[i];
+                cols.back().push_back (p);
+            }
+            n_entries += cols.back().size();
+        }
+    }
+};
+
+int main (int argc,
+          char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "usage: bench-micro <work_dir> [reps=5] "
+                     "[key=value...]"
+                  << std::endl;
+        return 1;
+    }
+    std::string dir = argv[1];
+    int reps = 5;
+    synth_params sp;
+    htsFile *fh = nullptr;
+    bam_hdr_t *head = nullptr;
+    hts_idx_t *idx = nullptr;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.find ('=') == std::string::npos)
+                reps = std::max (1, std::stoi (arg));
+            else if (!synth_param_set (sp, arg))
+                throw std::invalid_argument ("unknown parameter " + arg);
+        }
+        std::string aln_path = dir + "/bench-micro.bam";
+        size_t n_reads =
+            write_synthetic (aln_path, dir + "/bench-micro.fa", sp);
+        std::printf ("{\"bench\":\"synth\",\"reads\":%zu,%s}\n", n_reads,
+                     synth_params_json (sp).c_str());
+
+        fh = open_alignment (aln_path, AEVSettings{}, aln_opts{});
+        head = sam_hdr_read (fh);
+        if (head == NULL)
+            throw std::runtime_error ("failed to read header");
+        idx = sam_index_load (fh, aln_path.c_str());
+        if (idx == NULL)
+            throw std::runtime_error ("failed to load index file");
+
+        // a window from the middle of the contig, away from its edges
+        int64_t w_start = sp.contig_len / 2;
+        int64_t w_end = std::min (sp.contig_len, w_start + 2000);
+        std::vector<bam_ptr> recs;
+        {
+            hts_itr_t *it = sam_itr_queryi (idx, 0, w_start, w_end);
+            if (it == NULL)
+                throw std::runtime_error ("failed to query index");
+            bam_ptr b (bam_init1());
+            while (sam_itr_next (fh, it, b.get()) >= 0) {
+                recs.push_back (std::move (b));
+                b.reset (bam_init1());
+            }
+            sam_itr_destroy (it);
+        }
+        held_columns single (recs, w_start, w_end, false);
+        held_columns paired (recs, w_start, w_end, true);
+
+        count_params cp{30, 25, 0, 1000000, 0, 3844};
+        const int inner = 10;
+        size_t n_ops = inner * single.n_entries;
+
+        std::vector<PileupReadInfo> infos;
+        std::vector<std::pair<size_t, BaseInfo>> bases;
+        for (size_t c = 0; c < single.cols.size(); ++c) {
+            for (const bam_pileup1_t &p : single.cols[c]) {
+                infos.push_back (PileupReadInfo::from_pileup (p));
+                BaseInfo bi;
+                bi.from_pinfo (infos.back(), cp);
+                bases.emplace_back (c, bi);
+            }
+        }
+
+        report ("get_pileup_flag", reps, n_ops, [&] () {
+            uint64_t acc = 0;
+            for (int k = 0; k < inner; ++k) {
+                for (const PileupReadInfo &pi : infos)
+                    acc += get_pileup_flag (cp, pi);
+            }
+            g_sink = acc;
+        });
+
+        std::vector<int> result (single.cols.size() * N_FIELDS_PER_OBS);
+        report ("score_single", reps, n_ops, [&] () {
+            std::fill (result.begin(), result.end(), 0);
+            AlleleEventCounter aev (cp, result, AEVSettings{});
+            for (int k = 0; k < inner; ++k) {
+                for (const auto &cb : bases)
+                    aev._score_single (cb.second, cb.first);
+            }
+            g_sink = static_cast<uint64_t> (result[FIELD_NOBS]);
+        });
+
+        auto bench_columns = [&] (const char *name, held_columns &hc,
+                                  bool discard_overlaps) {
+            report (name, reps, inner * hc.n_entries, [&] () {
+                std::fill (result.begin(), result.end(), 0);
+                AlleleEventCounter aev (cp, result,
+                                        AEVSettings{discard_overlaps});
+                for (int k = 0; k < inner; ++k) {
+                    for (size_t c = 0; c < hc.cols.size(); ++c)
+                        aev.count_pileup (hc.cols[c].data(), c,
+                                          hc.cols[c].size());
+                }
+                g_sink = static_cast<uint64_t> (result[FIELD_NOBS]);
+            });
+        };
+        bench_columns ("count_pileup", single, false);
+        // the per-read path the batched kernel replaces, for reference
+        report ("count_reads", reps, n_ops, [&] () {
+            std::fill (result.begin(), result.end(), 0);
+            AlleleEventCounter aev (cp, result, AEVSettings{});
+            for (int k = 0; k < inner; ++k) {
+                for (size_t c = 0; c < single.cols.size(); ++c)
+                    aev._count_reads (single.cols[c].data(), c,
+                                      single.cols[c].size());
+            }
+            g_sink = static_cast<uint64_t> (result[FIELD_NOBS]);
+        });
+        bench_columns ("count_pileup_overlaps", paired, true);
+
+        // end to end: the whole contig through the pileup, and single
+        // positions through the point path
+        hts_region whole = hts_region::by_end (0, 0, sp.contig_len);
+        std::vector<int> whole_result (whole.rlen * N_FIELDS_PER_OBS);
+        for (bool overlaps : {false, true}) {
+            report (overlaps ? "count_region_overlaps" : "count_region",
+                    reps, whole.rlen, [&] () {
+                std::fill (whole_result.begin(), whole_result.end(), 0);
+                AlleleEventCounter aev (cp, whole_result,
+                                        AEVSettings{overlaps});
+                count (fh, idx, aev, whole, cp);
+            });
+        }
+
+        const size_t n_points = 1000;
+        int64_t step = std::max<int64_t> (
+            1, sp.contig_len / static_cast<int64_t> (n_points));
+        std::vector<int> point_result (N_FIELDS_PER_OBS);
+        report ("count_point", reps, n_points, [&] () {
+            for (size_t i = 0; i < n_points; ++i) {
+                int64_t pos = static_cast<int64_t> (i) * step %
+                    sp.contig_len;
+                std::fill (point_result.begin(), point_result.end(), 0);
+                AlleleEventCounter aev (cp, point_result, AEVSettings{});
+                count (fh, idx, aev, hts_region::by_end (0, pos, pos + 1),
+                       cp);
+            }
+        });
+
+        for (size_t i = 0; i < recs.size(); ++i) {
+            single.reads.release (recs[i].get(), single.metas[i]);
+            paired.reads.release (recs[i].get(), paired.metas[i]);
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Error during benchmark: " << e.what()
+                  << std::endl;
+        if (idx)
+            hts_idx_destroy (idx);
+        if (head)
+            bam_hdr_destroy (head);
+        if (fh)
+            hts_close (fh);
+        return 1;
+    }
+    hts_idx_destroy (idx);
+    bam_hdr_destroy (head);
+    hts_close (fh);
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+// Throughput of count() over one region as the size of the htslib
+// decompression pool grows. Prints one JSON object per line:
+//   {"bench":"threads","threads":N,"reps":R,"seconds":S,"pos_per_s":P}
+//
+// usage: bench-threads <aln> <region> [max_threads=8] [reps=3]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "aln.hpp"
+#include "count.hpp"
+#include "regions.hpp"
+
+static double time_count (const std::string &aln_path,
+                          const std::string &region_str,
+                          int n_threads) {
+    HtsThreadPool pool (n_threads);
+    htsFile *fh = open_alignment (aln_path, AEVSettings{},
+                                  aln_opts{"", &pool});
+    bam_hdr_t *head = sam_hdr_read (fh);
+    if (head == NULL)
+        throw std::runtime_error ("failed to read header");
+    hts_idx_t *idx = sam_index_load (fh, aln_path.c_str());
+    if (idx == NULL)
+        throw std::runtime_error ("failed to load index file");
+    hts_region reg = parse_region (head, region_str);
+
+    count_params cp{30, 25, 0, 1000000, 0, 3844};
+    std::vector<int> result (reg.rlen * N_FIELDS_PER_OBS, 0);
+
+    // only the counting itself is timed, setup is the same for all N
+    auto t0 = std::chrono::steady_clock::now();
+    AlleleEventCounter aev (cp, result, AEVSettings{});
+    count (fh, idx, aev, reg, cp);
+    auto t1 = std::chrono::steady_clock::now();
+
+    hts_idx_destroy (idx);
+    bam_hdr_destroy (head);
+    hts_close (fh);
+    return std::chrono::duration<double> (t1 - t0).count();
+}
+
+int main (int argc,
+          char *argv[]) {
+    if (argc < 3) {
+        std::cerr << "usage: bench-threads <aln> <region> "
+                     "[max_threads=8] [reps=3]"
+                  << std::endl;
+        return 1;
+    }
+    std::string aln_path = argv[1];
+    std::string region_str = argv[2];
+    int max_threads = argc > 3 ? std::stoi (argv[3]) : 8;
+    int reps = argc > 4 ? std::stoi (argv[4]) : 3;
+
+    try {
+        size_t rlen;
+        {
+            htsFile *fh = hts_open (aln_path.c_str(), "r");
+            if (fh == NULL)
+                throw std::runtime_error (
+                    "failed to read alignment file");
+            bam_hdr_t *head = sam_hdr_read (fh);
+            if (head == NULL)
+                throw std::runtime_error ("failed to read header");
+            rlen = parse_region (head, region_str).rlen;
+            bam_hdr_destroy (head);
+            hts_close (fh);
+        }
+
+        std::vector<int> thread_counts{0};
+        for (int n = 1; n <= max_threads; n *= 2)
+            thread_counts.push_back (n);
+
+        for (int n : thread_counts) {
+            // best of reps, to damp page cache and scheduling noise
+            double best = -1;
+            for (int r = 0; r < reps; ++r) {
+                double s = time_count (aln_path, region_str, n);
+                best = best < 0 ? s : std::min (best, s);
+            }
+            std::printf ("{\"bench\":\"threads\",\"threads\":%d,"
+                         "\"reps\":%d,\"seconds\":%.6f,"
+                         "\"pos_per_s\":%.1f}\n",
+                         n, reps, best,
+                         static_cast<double> (rlen) / best);
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Error during benchmark: " << e.what()
+                  << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,18 @@
+# fails unless REPORT, GCC's -fopt-info-vec-optimized output for
+# bench-micro, has a loop of pileup.hpp vectorised. GCC appends to the
+# report, so it is removed once checked; none means bench-micro was
+# relinked without being recompiled. Only optimised builds are
+# checked, as others vectorise nothing
+if(NOT EXISTS "${REPORT}")
+  return()
+endif()
+file(STRINGS "${REPORT}" vectorised
+  REGEX "pileup\\.hpp:[0-9]+:[0-9]+: optimized: loop vectorized")
+file(REMOVE "${REPORT}")
+if(NOT CONFIG STREQUAL "Release" AND NOT CONFIG STREQUAL "RelWithDebInfo")
+  return()
+endif()
+if(NOT vectorised)
+  message(FATAL_ERROR
+    "the column counting kernel in pileup.hpp was not vectorised")
+endif()
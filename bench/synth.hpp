@@ -0,0 +1,301 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+// Synthetic paired-end alignments for benchmarking, written with
+// htslib's own writers so they exercise the same decoding paths as
+// real data
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <htslib/faidx.h>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct synth_params {
+    int64_t contig_len = 200000; // of each contig
+    int n_contigs = 1; // named synth, synth2, synth3...
+    int depth = 60; // mean coverage
+    int read_len = 150;
+    double indel_rate = 0.001; // per base, chance an indel opens
+    double overlap_fraction = 0.5; // of templates whose mates overlap
+    double error_rate = 0.005; // per base substitutions
+    uint32_t seed = 1;
+};
+
+// set a field of p from a key=value argument, false if key is unknown
+inline bool synth_param_set (synth_params &p,
+                             const std::string &arg) {
+    size_t eq = arg.find ('=');
+    if (eq == std::string::npos)
+        return false;
+    std::string key = arg.substr (0, eq);
+    std::string val = arg.substr (eq + 1);
+    if (key == "contig_len")
+        p.contig_len = std::stoll (val);
+    else if (key == "n_contigs")
+        p.n_contigs = std::stoi (val);
+    else if (key == "depth")
+        p.depth = std::stoi (val);
+    else if (key == "read_len")
+        p.read_len = std::stoi (val);
+    else if (key == "indel_rate")
+        p.indel_rate = std::stod (val);
+    else if (key == "overlap_fraction")
+        p.overlap_fraction = std::stod (val);
+    else if (key == "error_rate")
+        p.error_rate = std::stod (val);
+    else if (key == "seed")
+        p.seed = static_cast<uint32_t> (std::stoul (val));
+    else
+        return false;
+    return true;
+}
+
+inline std::string synth_params_json (const synth_params &p) {
+    char buf[256];
+    std::snprintf (buf, sizeof (buf),
+                   "\"contig_len\":%lld,\"n_contigs\":%d,\"depth\":%d,"
+                   "\"read_len\":%d,\"indel_rate\":%g,"
+                   "\"overlap_fraction\":%g,\"error_rate\":%g,"
+                   "\"seed\":%u",
+                   static_cast<long long> (p.contig_len), p.n_contigs,
+                   p.depth, p.read_len, p.indel_rate, p.overlap_fraction,
+                   p.error_rate, p.seed);
+    return buf;
+}
+
+namespace synth_detail {
+
+struct read_rec {
+    int32_t tid;
+    int64_t pos;
+    uint16_t flag;
+    int64_t mpos;
+    int64_t isize;
+    std::string qname;
+    std::vector<uint32_t> cigar;
+    std::string seq;
+    std::string qual;
+};
+
+// a read of p.read_len bases from ref at pos, with substitutions and
+// short indels at the configured rates
+inline void simulate_read (const std::string &ref,
+                           int64_t pos,
+                           const synth_params &p,
+                           std::mt19937_64 &rng,
+                           read_rec &r) {
+    std::uniform_real_distribution<double> unit (0, 1);
+    std::uniform_int_distribution<int> base (0, 3), indel_len (1, 3),
+        qual (20, 40);
+    const char bases[] = "ACGT";
+    r.pos = pos;
+    r.cigar.clear();
+    r.seq.clear();
+    r.qual.clear();
+    auto push_op = [&r] (uint32_t len, uint32_t op) {
+        if (!r.cigar.empty() && bam_cigar_op (r.cigar.back()) == op) {
+            r.cigar.back() += len << BAM_CIGAR_SHIFT;
+            return;
+        }
+        r.cigar.push_back (len << BAM_CIGAR_SHIFT | op);
+    };
+    auto add_base = [&] (char b) {
+        r.seq.push_back (b);
+        r.qual.push_back (static_cast<char> (qual (rng)));
+    };
+
+    int64_t x = pos;
+    int n = p.read_len;
+    while (static_cast<int> (r.seq.size()) < n &&
+           x < static_cast<int64_t> (ref.size())) {
+        bool after_match = !r.cigar.empty() &&
+            bam_cigar_op (r.cigar.back()) == BAM_CMATCH;
+        double u = unit (rng);
+        if (after_match && u < p.indel_rate / 2) {
+            int l = std::min (indel_len (rng),
+                              n - static_cast<int> (r.seq.size()));
+            for (int i = 0; i < l; ++i)
+                add_base (bases[base (rng)]);
+            push_op (static_cast<uint32_t> (l), BAM_CINS);
+        } else if (after_match && u < p.indel_rate) {
+            int l = indel_len (rng);
+            x += l;
+            push_op (static_cast<uint32_t> (l), BAM_CDEL);
+        } else {
+            char b = ref[static_cast<size_t> (x++)];
+            if (unit (rng) < p.error_rate) {
+                // any base but the reference's
+                char alt;
+                while ((alt = bases[base (rng)]) == b)
+                    ;
+                b = alt;
+            }
+            add_base (b);
+            push_op (1, BAM_CMATCH);
+        }
+    }
+    // reads end on an aligned base
+    while (!r.cigar.empty() &&
+           bam_cigar_op (r.cigar.back()) != BAM_CMATCH) {
+        uint32_t l = bam_cigar_oplen (r.cigar.back());
+        if (bam_cigar_op (r.cigar.back()) == BAM_CINS) {
+            r.seq.resize (r.seq.size() - l);
+            r.qual.resize (r.qual.size() - l);
+        }
+        r.cigar.pop_back();
+    }
+}
+
+inline int64_t ref_end (const read_rec &r) {
+    int64_t end = r.pos;
+    for (uint32_t c : r.cigar) {
+        int op = bam_cigar_op (c);
+        if (op == BAM_CMATCH || op == BAM_CDEL)
+            end += bam_cigar_oplen (c);
+    }
+    return end;
+}
+
+} // namespace synth_detail
+
+// name of contig tid of the synthetic reference
+inline std::string synth_contig (int tid) {
+    return tid == 0 ? "synth" : "synth" + std::to_string (tid + 1);
+}
+
+// write a random reference to ref_path (indexed alongside) and
+// coordinate sorted, indexed read pairs over it to aln_path, as CRAM
+// if aln_path ends in .cram and otherwise as BAM. Returns the number
+// of reads written
+inline size_t write_synthetic (const std::string &aln_path,
+                               const std::string &ref_path,
+                               const synth_params &p) {
+    using namespace synth_detail;
+    if (p.contig_len < 2 * p.read_len || p.read_len < 1 || p.depth < 1)
+        throw std::invalid_argument (
+            "synthetic contig must fit a read pair");
+    if (p.n_contigs < 1)
+        throw std::invalid_argument ("synthetic reference needs a contig");
+    std::mt19937_64 rng (p.seed);
+    const char bases[] = "ACGT";
+    std::uniform_int_distribution<int> base (0, 3);
+
+    std::vector<std::string> refs (static_cast<size_t> (p.n_contigs));
+    for (std::string &ref : refs) {
+        ref.assign (static_cast<size_t> (p.contig_len), 'A');
+        for (char &c : ref)
+            c = bases[base (rng)];
+    }
+    {
+        FILE *fa = std::fopen (ref_path.c_str(), "w");
+        if (fa == NULL)
+            throw std::runtime_error ("failed to write " + ref_path);
+        for (size_t tid = 0; tid < refs.size(); ++tid) {
+            const std::string &ref = refs[tid];
+            std::fprintf (fa, ">%s\n",
+                          synth_contig (static_cast<int> (tid)).c_str());
+            for (size_t i = 0; i < ref.size(); i += 60) {
+                std::fprintf (fa, "%s\n", ref.substr (i, 60).c_str());
+            }
+        }
+        if (std::fclose (fa) != 0)
+            throw std::runtime_error ("failed to write " + ref_path);
+    }
+    if (fai_build (ref_path.c_str()) != 0)
+        throw std::runtime_error ("failed to index " + ref_path);
+
+    // templates enough for the requested mean depth, per contig
+    size_t n_templates = static_cast<size_t> (
+        p.contig_len * p.depth / (2 * p.read_len));
+    std::uniform_real_distribution<double> unit (0, 1);
+    std::uniform_int_distribution<int64_t> frag_overlap (
+        p.read_len, 2 * p.read_len - 1),
+        frag_apart (2 * p.read_len, 3 * p.read_len);
+    std::vector<read_rec> recs;
+    recs.reserve (2 * n_templates * refs.size());
+    for (size_t t = 0; t < n_templates * refs.size(); ++t) {
+        int32_t tid = static_cast<int32_t> (t / n_templates);
+        const std::string &ref = refs[static_cast<size_t> (tid)];
+        int64_t frag = unit (rng) < p.overlap_fraction
+            ? frag_overlap (rng)
+            : frag_apart (rng);
+        frag = std::min (frag, p.contig_len);
+        std::uniform_int_distribution<int64_t> start (
+            0, p.contig_len - frag);
+        int64_t s = start (rng);
+        read_rec r1, r2;
+        simulate_read (ref, s, p, rng, r1);
+        simulate_read (ref, s + frag - p.read_len, p, rng, r2);
+        int64_t isize = ref_end (r2) - r1.pos;
+        r1.tid = r2.tid = tid;
+        r1.qname = r2.qname = "t" + std::to_string (t);
+        r1.flag = BAM_FPAIRED | BAM_FPROPER_PAIR | BAM_FREAD1 |
+            BAM_FMREVERSE;
+        r2.flag = BAM_FPAIRED | BAM_FPROPER_PAIR | BAM_FREAD2 |
+            BAM_FREVERSE;
+        r1.mpos = r2.pos;
+        r2.mpos = r1.pos;
+        r1.isize = isize;
+        r2.isize = -isize;
+        recs.push_back (std::move (r1));
+        recs.push_back (std::move (r2));
+    }
+    std::stable_sort (recs.begin(), recs.end(),
+                      [] (const read_rec &a, const read_rec &b) {
+                          return a.tid != b.tid ? a.tid < b.tid
+                                                : a.pos < b.pos;
+                      });
+
+    bool is_cram = aln_path.size() > 5 &&
+        aln_path.compare (aln_path.size() - 5, 5, ".cram") == 0;
+    htsFile *fh = hts_open (aln_path.c_str(), is_cram ? "wc" : "wb");
+    if (fh == NULL)
+        throw std::runtime_error ("failed to open " + aln_path);
+    std::string text = "@HD\tVN:1.6\tSO:coordinate\n";
+    for (int tid = 0; tid < p.n_contigs; ++tid)
+        text += "@SQ\tSN:" + synth_contig (tid) + "\tLN:" +
+            std::to_string (p.contig_len) + "\n";
+    sam_hdr_t *head = sam_hdr_parse (text.size(), text.c_str());
+    bam1_t *b = bam_init1();
+    try {
+        if (head == NULL || b == NULL)
+            throw std::runtime_error ("failed to set up writer");
+        if (is_cram && hts_set_fai_filename (fh, ref_path.c_str()) != 0)
+            throw std::runtime_error ("failed to set CRAM reference");
+        if (sam_hdr_write (fh, head) < 0)
+            throw std::runtime_error ("failed to write header");
+        for (const read_rec &r : recs) {
+            // qualities are raw phred scores, without the +33 offset
+            if (bam_set1 (b, r.qname.size(), r.qname.c_str(), r.flag,
+                          r.tid, r.pos, 60, r.cigar.size(), r.cigar.data(),
+                          r.tid,
+                          r.mpos, r.isize, r.seq.size(), r.seq.c_str(),
+                          r.qual.c_str(), 0) < 0 ||
+                sam_write1 (fh, head, b) < 0)
+                throw std::runtime_error ("failed to write read");
+        }
+    } catch (...) {
+        bam_destroy1 (b);
+        if (head)
+            sam_hdr_destroy (head);
+        hts_close (fh);
+        throw;
+    }
+    bam_destroy1 (b);
+    sam_hdr_destroy (head);
+    if (hts_close (fh) != 0)
+        throw std::runtime_error ("failed to close " + aln_path);
+    if (sam_index_build (aln_path.c_str(), 0) != 0)
+        throw std::runtime_error ("failed to index " + aln_path);
+    return recs.size();
+}
@@ -0,0 +1,125 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <cstdlib>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <htslib/thread_pool.h>
+#include <stdexcept>
+#include <string>
+
+#include "pileup.hpp"
+
+// owns an htslib thread pool which can be shared between any number
+// of open alignment files. BGZF/CRAM blocks are then decoded by the
+// pool ahead of the reader, overlapping with counting on the calling
+// thread. Files using the pool must be closed before it is destroyed
+class HtsThreadPool {
+  private:
+    htsThreadPool tp{nullptr, 0};
+
+  public:
+    // n_threads < 1 gives an inactive pool; attach() is then a no-op
+    explicit HtsThreadPool (int n_threads) {
+        if (n_threads > 0) {
+            tp.pool = hts_tpool_init (n_threads);
+            if (tp.pool == NULL) {
+                throw std::runtime_error (
+                    "failed to create htslib thread pool");
+            }
+        }
+    }
+
+    HtsThreadPool (const HtsThreadPool &) = delete;
+    HtsThreadPool &operator= (const HtsThreadPool &) = delete;
+
+    ~HtsThreadPool () {
+        if (tp.pool)
+            hts_tpool_destroy (tp.pool);
+    }
+
+    bool active () const noexcept { return tp.pool != nullptr; }
+
+    void attach (htsFile *fh) {
+        if (!active())
+            return;
+        if (hts_set_opt (fh, HTS_OPT_THREAD_POOL, &tp) != 0) {
+            throw std::runtime_error (
+                "failed to attach thread pool to alignment file");
+        }
+    }
+};
+
+// how alignment files are opened for counting
+struct aln_opts {
+    std::string reference = ""; // fasta (with .fai) to decode CRAM
+    HtsThreadPool *pool = nullptr; // shared decompression pool
+    bool read_names = false; // decode CRAM qnames (downsampling)
+};
+
+// CRAM records are only decoded as far as counting needs. Aux tags,
+// mate fields and MD/NM generation are skipped; qnames are only
+// needed to pair mates when discarding overlaps, or to downsample
+inline int cram_required_fields (const AEVSettings &settings,
+                                 const aln_opts &opts = {}) {
+    int fields = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ |
+        SAM_CIGAR | SAM_SEQ | SAM_QUAL;
+    if (settings.discard_overlaps || opts.read_names)
+        fields |= SAM_QNAME;
+    return fields;
+}
+
+inline void configure_cram (htsFile *fh,
+                            const AEVSettings &settings,
+                            const aln_opts &opts) {
+    if (!opts.reference.empty() &&
+        hts_set_fai_filename (fh, opts.reference.c_str()) != 0) {
+        throw std::runtime_error ("failed to use reference " +
+                                  opts.reference);
+    }
+    if (hts_set_opt (fh, CRAM_OPT_REQUIRED_FIELDS,
+                     cram_required_fields (settings, opts)) != 0 ||
+        hts_set_opt (fh, CRAM_OPT_DECODE_MD, 0) != 0) {
+        throw std::runtime_error ("failed to set CRAM decode options");
+    }
+}
+
+// open an alignment file for counting. Caller owns the handle
+inline htsFile *open_alignment (const std::string &path,
+                                const AEVSettings &settings,
+                                const aln_opts &opts) {
+    htsFile *fh = hts_open (path.c_str(), "r");
+    if (fh == NULL) {
+        throw std::runtime_error ("failed to read alignment file");
+    }
+    try {
+        if (opts.pool)
+            opts.pool->attach (fh);
+        if (hts_get_format (fh)->format == cram)
+            configure_cram (fh, settings, opts);
+    } catch (...) {
+        hts_close (fh);
+        throw;
+    }
+    return fh;
+}
+
+// htslib looks up CRAM reference sequences by MD5 in REF_CACHE
+// before REF_PATH (which defaults to a remote server), and stores
+// any it has to fetch there. A bare directory is given the usual
+// samtools layout. Sets process environment, so call once before
+// opening files rather than from worker threads
+inline void use_ref_cache (const std::string &dir) {
+    if (dir.empty())
+        return;
+    std::string pattern = dir;
+    if (pattern.find ('%') == std::string::npos)
+        pattern += "/%2s/%2s/%s";
+    if (setenv ("REF_CACHE", pattern.c_str(), 1) != 0) {
+        throw std::runtime_error ("failed to set REF_CACHE");
+    }
+}
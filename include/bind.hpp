@@ -5,10 +5,185 @@
 
 #pragma once
 
+#include "aln.hpp"
+#include "cache.hpp"
 #include "count.hpp"
+#include "multi.hpp"
+#include "output.hpp"
+#include "regions.hpp"
 #include <htslib/hts.h>
 #include <htslib/sam.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
+// names of the columns of each row of counts
+inline std::vector<std::string> count_columns () {
+    return header_columns();
+}
+
+// cell_alloc sizing v to hold the result
+inline cell_alloc vector_alloc (std::vector<int> &v) {
+    return [&v] (size_t n_cells) {
+        v.assign (n_cells, 0);
+        return v.data();
+    };
+}
+
+// an alignment file opened once, with its header, index and optional
+// decompression pool, then counted over any number of regions. All
+// are released by close() or on destruction, whichever comes first.
+// Given a cache_dir, results are kept there (up to cache_mib MiB)
+// and repeat counts of a region with the same parameters read back
+class PileupReader {
+  private:
+    std::string path;
+    std::unique_ptr<HtsThreadPool> pool; // outlives fh
+    htsFile *fh = nullptr;
+    bam_hdr_t *head = nullptr;
+    hts_idx_t *idx = nullptr;
+    aln_opts opts;
+    AEVSettings opened_with;
+    std::unique_ptr<ResultCache> cache;
+
+  public:
+    PileupReader (std::string aln_path,
+                  int threads = 0,
+                  std::string reference = "",
+                  std::string ref_cache = "",
+                  std::string cache_dir = "",
+                  int cache_mib = static_cast<int> (CACHE_DEFAULT_MIB))
+        : path (aln_path) {
+        try {
+            use_ref_cache (ref_cache);
+            if (!cache_dir.empty()) {
+                if (cache_mib < 1)
+                    throw std::runtime_error (
+                        "cache size must be at least 1 MiB");
+                cache = std::make_unique<ResultCache> (
+                    cache_dir, static_cast<uint64_t> (cache_mib));
+            }
+            pool = std::make_unique<HtsThreadPool> (threads);
+            opts = aln_opts{reference, pool.get()};
+            fh = open_alignment (path, opened_with, opts);
+            head = sam_hdr_read (fh);
+            if (head == NULL) {
+                throw std::runtime_error (
+                    "failed to get header from alignment file");
+            }
+            idx = sam_index_load (fh, path.c_str());
+            if (idx == NULL) {
+                throw std::runtime_error ("failed to load index file");
+            }
+        } catch (std::exception &e) {
+            close();
+            throw std::runtime_error ("Error during setup: " +
+                                      std::string (e.what()));
+        }
+    }
+
+    PileupReader (const PileupReader &) = delete;
+    PileupReader &operator= (const PileupReader &) = delete;
+
+    ~PileupReader () { close(); }
+
+    void close () {
+        if (idx)
+            hts_idx_destroy (idx);
+        if (head)
+            bam_hdr_destroy (head);
+        if (fh)
+            hts_close (fh);
+        idx = nullptr;
+        head = nullptr;
+        fh = nullptr;
+        pool.reset();
+    }
+
+    bool is_open () const { return fh != nullptr; }
+
+    // count region_str into a buffer from alloc, returning it
+    int *count_into (const std::string &region_str,
+                     const count_params &cp,
+                     const AEVSettings &settings,
+                     const cell_alloc &alloc) {
+        if (!is_open())
+            throw std::runtime_error ("PileupReader is closed");
+
+        hts_region reg;
+        int *cells = nullptr;
+        size_t n_cells = 0;
+        std::string key;
+        try {
+            // CRAM only decodes qnames when pairing mates
+            if (settings.discard_overlaps !=
+                    opened_with.discard_overlaps &&
+                hts_get_format (fh)->format == cram) {
+                configure_cram (fh, settings, opts);
+                opened_with = settings;
+            }
+
+            reg = parse_region (head, region_str);
+
+            safe_size_opts sso;
+            sso.msg =
+                "error in calculating cells needed for storing result";
+            n_cells = safe_size (
+                static_cast<int64_t> (reg.rlen * N_FIELDS_PER_OBS),
+                sso);
+            if (cache) {
+                key = cache_key (path, reg, cp, settings);
+                // straight into the caller's buffer, allocated once
+                // the entry is found whole
+                if (cache->replay (key, n_cells,
+                                   [&] (size_t first, const int *block,
+                                        size_t n) {
+                                       if (cells == nullptr)
+                                           cells = alloc (n_cells);
+                                       std::copy_n (block, n,
+                                                    cells + first);
+                                   }))
+                    return cells;
+            }
+            cells = alloc (n_cells);
+        } catch (std::exception &e) {
+            throw std::runtime_error ("Error during setup: " +
+                                      std::string (e.what()));
+        }
+
+        try {
+            AlleleEventCounter aev (cp, cells, settings);
+            ::count (fh, idx, aev, reg, cp);
+        } catch (std::exception &e) {
+            throw std::runtime_error ("Error during calculation: " +
+                                      std::string (e.what()));
+        }
+        if (cache)
+            cache->store (key, cells, n_cells);
+        return cells;
+    }
+
+    std::vector<int> count (std::string region_str,
+                            bool no_overlaps = false,
+                            int min_mapq = 25,
+                            int min_baseq = 30,
+                            int include_flag = 0,
+                            int exclude_flag = 3844,
+                            int max_depth = 1000000,
+                            int clip_bound = 0) {
+        count_params cp{min_baseq, min_mapq,     clip_bound,
+                        max_depth, include_flag, exclude_flag};
+        std::vector<int> result;
+        count_into (region_str, cp, AEVSettings{no_overlaps},
+                    vector_alloc (result));
+        return result;
+    }
+};
+
+// count one region, opening and closing the file for the call. Use a
+// PileupReader to count many regions of the same file
 inline std::vector<int> count_events (std::string aln_path,
                                       std::string region_str,
                                       bool no_overlaps = false,
@@ -17,76 +192,89 @@ inline std::vector<int> count_events (std::string aln_path,
                                       int include_flag = 0,
                                       int exclude_flag = 3844,
                                       int max_depth = 1000000,
-                                      int clip_bound = 0) {
-    htsFile *aln_in=nullptr;
-    bam_hdr_t *head=nullptr;
-    hts_region reg;
+                                      int clip_bound = 0,
+                                      int threads = 0,
+                                      std::string reference = "",
+                                      std::string ref_cache = "",
+                                      std::string cache_dir = "") {
+    PileupReader reader (aln_path, threads, reference, ref_cache,
+                         cache_dir);
+    return reader.count (region_str, no_overlaps, min_mapq, min_baseq,
+                         include_flag, exclude_flag, max_depth,
+                         clip_bound);
+}
+
+// count each alignment file over the same regions on up to threads
+// workers. The result is sample-stacked: for each sample in turn, the
+// rows of each region in turn, N_FIELDS_PER_OBS cells per row
+inline std::vector<int>
+count_events_samples (std::vector<std::string> aln_paths,
+                      std::vector<std::string> region_strs,
+                      bool no_overlaps = false,
+                      int min_mapq = 25,
+                      int min_baseq = 30,
+                      int include_flag = 0,
+                      int exclude_flag = 3844,
+                      int max_depth = 1000000,
+                      int clip_bound = 0,
+                      int threads = 1,
+                      std::string reference = "",
+                      std::string ref_cache = "") {
     count_params cp{min_baseq, min_mapq,     clip_bound,
                     max_depth, include_flag, exclude_flag};
-
-    hts_idx_t *idx=nullptr;
-    int tid = -3;
-    int64_t start, end;
     std::vector<int> result;
     try {
-        aln_in = hts_open (aln_path.c_str(), "r");
-        head = sam_hdr_read (aln_in);
-        if (head == NULL) {
-            throw std::runtime_error (
-                "failed to get header from alignment file");
-        }
-
-        auto rp =
-            sam_parse_region (head, region_str.c_str(), &tid, &start,
-                              &end, HTS_PARSE_ONE_COORD);
-        if (rp == NULL) {
-            std::string msg;
-            switch (tid) {
-                case -2:
-                    msg = "memory error";
-                    break;
-                case -1:
-                    msg = "could not parse contig";
-                    break;
-                default:
-                    msg = "specified range could not be parsed";
-            }
-            throw std::runtime_error (
-                "parse failed for input region " + region_str +
-                " - " + msg);
-        }
-        // converts to 0-indexed internal postions from 1-indexed
-        // region str
-        reg = hts_region::by_end (tid, start, end);
-
-        idx = sam_index_load (aln_in, aln_path.c_str());
-        if (idx == NULL) {
-            throw std::runtime_error ("failed to load index file");
-        }
-
-        safe_size_opts sso;
-        sso.msg =
-            "error in calculating cells needed for storing result";
-        size_t n_cells = safe_size (
-            static_cast<int64_t> (reg.rlen * N_FIELDS_PER_OBS));
-        result.resize (n_cells, 0);
-
+        use_ref_cache (ref_cache);
+        count_samples (aln_paths, region_strs, cp,
+                       AEVSettings{no_overlaps},
+                       static_cast<size_t> (std::max (1, threads)),
+                       aln_opts{reference, nullptr},
+                       vector_alloc (result));
     } catch (std::exception &e) {
-        throw std::runtime_error ("Error during setup: " +
-                                  std::to_string (*e.what()));
+        throw std::runtime_error ("Error during calculation: " +
+                                  std::string (e.what()));
     }
+    return result;
+}
 
+// counts of several regions stacked in order: region i has the rows
+// [offsets[i], offsets[i + 1]) of N_FIELDS_PER_OBS cells each
+struct stacked_counts {
+    std::vector<int> counts;
+    std::vector<size_t> offsets;
+};
+
+// count many regions of one file on up to threads worker threads, each
+// with its own file handle while sharing the header and index loaded
+// once for the call
+inline stacked_counts
+count_events_many (std::string aln_path,
+                   std::vector<std::string> region_strs,
+                   int threads = 1,
+                   bool no_overlaps = false,
+                   int min_mapq = 25,
+                   int min_baseq = 30,
+                   int include_flag = 0,
+                   int exclude_flag = 3844,
+                   int max_depth = 1000000,
+                   int clip_bound = 0,
+                   std::string reference = "",
+                   std::string ref_cache = "") {
+    count_params cp{min_baseq, min_mapq,     clip_bound,
+                    max_depth, include_flag, exclude_flag};
+    stacked_counts result;
     try {
-        AlleleEventCounter aev (cp, result, AEVSettings{no_overlaps});
-        count (aln_in, idx, aev, reg, cp);
+        use_ref_cache (ref_cache);
+        result.offsets =
+            count_samples ({aln_path}, region_strs, cp,
+                           AEVSettings{no_overlaps},
+                           static_cast<size_t> (std::max (1, threads)),
+                           aln_opts{reference, nullptr},
+                           vector_alloc (result.counts))
+                .region_offsets;
     } catch (std::exception &e) {
         throw std::runtime_error ("Error during calculation: " +
-                                  std::to_string (*e.what()));
+                                  std::string (e.what()));
     }
-
-    hts_close (aln_in);
-    bam_hdr_destroy (head);
-    hts_idx_destroy (idx);
-
     return result;
 }
@@ -7,6 +7,7 @@
 
 #include <cstdint>
 #include <limits>
+#include <stdexcept>
 #include <string>
 
 struct safe_size_opts {
@@ -15,23 +16,60 @@ struct safe_size_opts {
     std::string msg = "";
 };
 
-inline size_t safe_size (int64_t i,
-                         safe_size_opts opts = {}) {
-    try {
-        if (i < 0)
-            throw std::out_of_range ("size would be negative");
+// the failure of a bounds check, built only once one has failed
+[[noreturn]] inline void bounds_fail (const char *msg,
+                                      const char *what) {
+    throw std::runtime_error (std::string (msg) + ": " + what);
+}
 
-        // cast fine since we know non negative now
-        if (static_cast<uint64_t> (i) < opts.lower)
-            throw std::out_of_range (
-                "size would be below lower bound");
+// i as a size within [lower, upper], or throws with msg
+inline size_t checked_size (int64_t i,
+                            const char *msg,
+                            size_t lower = 0,
+                            size_t upper =
+                                std::numeric_limits<size_t>::max()) {
+    if (i < 0)
+        bounds_fail (msg, "size would be negative");
+    // cast fine since we know non negative now
+    if (static_cast<uint64_t> (i) < lower)
+        bounds_fail (msg, "size would be below lower bound");
+    if (static_cast<uint64_t> (i) > upper)
+        bounds_fail (msg, "size would exceed upper bound");
+    // convert in peace
+    return static_cast<size_t> (i);
+}
 
-        if (static_cast<uint64_t> (i) > opts.upper)
-            throw std::out_of_range ("size would exceed upper bound");
+inline size_t safe_size (int64_t i,
+                         const safe_size_opts &opts = {}) {
+    return checked_size (i, opts.msg.c_str(), opts.lower, opts.upper);
+}
 
-        // convert in peace
+// conversions on hot paths (per column or per base) go through a
+// policy fixed at compile time. Checked, every conversion is tested
+// as safe_size would; unchecked, it is a plain cast, relying on the
+// caller having validated its inputs once up front. Debug builds
+// (ENABLE_DEBUG_FLAGS) define PEV_CHECKED_BOUNDS
+struct checked_bounds {
+    static constexpr bool checked = true;
+    static size_t size (int64_t i,
+                        const char *msg,
+                        size_t upper =
+                            std::numeric_limits<size_t>::max()) {
+        return checked_size (i, msg, 0, upper);
+    }
+};
+
+struct unchecked_bounds {
+    static constexpr bool checked = false;
+    static size_t size (int64_t i,
+                        const char *,
+                        size_t = std::numeric_limits<size_t>::max()) {
         return static_cast<size_t> (i);
-    } catch (std::exception &e) {
-        throw std::runtime_error (opts.msg + ": " + e.what());
     }
-}
+};
+
+#ifdef PEV_CHECKED_BOUNDS
+using hot_bounds = checked_bounds;
+#else
+using hot_bounds = unchecked_bounds;
+#endif
@@ -0,0 +1,504 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "const.hpp"
+#include "pileup.hpp"
+#include "structs.hpp"
+
+// counts of whole regions kept on disk between runs, one file per
+// entry in a cache directory, so repeat queries of the same file,
+// region and parameters skip counting. Entries are written to a
+// temporary file and renamed into place, so several processes can
+// share a directory. Once the directory exceeds its size bound the
+// least recently used entries (by mtime, refreshed on each hit) are
+// removed
+//
+// entry layout:
+//   8 bytes   magic "PEVCAC", format version, COUNTS_VERSION
+//   4 bytes   key length k, uint32 little-endian
+//   k bytes   key (see cache_key), checked on load
+//   8 bytes   number of cells, uint64 little-endian
+//   rest      cells as varints: zigzag(v) for v != 0, or 0 then the
+//             length of a run of zero cells
+inline constexpr uint8_t CACHE_FORMAT = 1;
+inline constexpr char CACHE_MAGIC[8] = {
+    'P', 'E', 'V', 'C', 'A', 'C', static_cast<char> (CACHE_FORMAT),
+    static_cast<char> (COUNTS_VERSION)};
+inline constexpr const char *CACHE_SUFFIX = ".pevc";
+inline constexpr uint64_t CACHE_DEFAULT_MIB = 1024;
+
+// what a result depends on: the version of counting, the alignment
+// file's identity (resolved path, size and mtime), the region, and
+// every parameter of counting.
+// Empty when the file cannot be identified (e.g. a URL), so cannot be
+// cached
+inline std::string cache_key (const std::string &aln_path,
+                              const hts_region &reg,
+                              const count_params &cp,
+                              const AEVSettings &settings) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path file = fs::canonical (aln_path, ec);
+    if (ec)
+        return "";
+    uintmax_t size = fs::file_size (file, ec);
+    if (ec)
+        return "";
+    auto mtime = fs::last_write_time (file, ec);
+    if (ec)
+        return "";
+
+    auto n = [] (auto v) { return std::to_string (v) + ";"; };
+    return std::string (VERSION) + ";" + n (int{COUNTS_VERSION}) +
+        file.string() + ";" + n (size) + n (mtime.time_since_epoch().count()) +
+        n (reg.rid) + n (reg.start) + n (reg.end) + n (cp.min_baseq) +
+        n (cp.min_mapq) + n (cp.clip_bound) + n (cp.max_depth) +
+        n (cp.include_flag) + n (cp.exclude_flag) +
+        n (cp.keep_below) + n (cp.downsample_seed) +
+        n (cp.downsample_depth) + n (settings.discard_overlaps);
+}
+
+class ResultCache {
+  private:
+    std::filesystem::path dir;
+    uint64_t max_bytes;
+    // the directory's size as of the last scan plus what this cache
+    // has stored since; UINT64_MAX before the first scan. Other
+    // processes' entries are only seen at the next scan
+    uint64_t used_estimate = UINT64_MAX;
+
+    static uint64_t fnv1a (const std::string &s,
+                           uint64_t h) {
+        for (char c : s) {
+            h ^= static_cast<uint8_t> (c);
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    // entry file of key, named by two independent hashes of it
+    std::filesystem::path entry_path (const std::string &key) const {
+        char name[33];
+        std::snprintf (
+            name, sizeof name, "%016llx%016llx",
+            static_cast<unsigned long long> (
+                fnv1a (key, 14695981039346656037ULL)),
+            static_cast<unsigned long long> (
+                fnv1a (key, 0x6c62272e07bb0142ULL)));
+        return dir / (std::string (name) + CACHE_SUFFIX);
+    }
+
+    static void put_varint (std::string &out,
+                            uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back (static_cast<char> (v | 0x80));
+            v >>= 7;
+        }
+        out.push_back (static_cast<char> (v));
+    }
+
+    static void put_le (std::string &out,
+                        uint64_t v,
+                        int n_bytes) {
+        for (int i = 0; i < n_bytes; ++i)
+            out.push_back (static_cast<char> (v >> (8 * i)));
+    }
+
+    // an entry file read in chunks, byte by byte
+    struct entry_reader {
+        FILE *fp;
+        char buf[1 << 16];
+        size_t at = 0;
+        size_t len = 0;
+
+        bool byte (uint8_t &b) {
+            if (at == len) {
+                len = std::fread (buf, 1, sizeof buf, fp);
+                at = 0;
+                if (len == 0)
+                    return false;
+            }
+            b = static_cast<uint8_t> (buf[at++]);
+            return true;
+        }
+
+        bool varint (uint64_t &v) {
+            v = 0;
+            uint8_t b;
+            for (int shift = 0; shift < 64 && byte (b); shift += 7) {
+                v |= static_cast<uint64_t> (b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    return true;
+            }
+            return false;
+        }
+
+        bool le (uint64_t &v,
+                 int n_bytes) {
+            v = 0;
+            uint8_t b;
+            for (int i = 0; i < n_bytes; ++i) {
+                if (!byte (b))
+                    return false;
+                v |= static_cast<uint64_t> (b) << (8 * i);
+            }
+            return true;
+        }
+
+        bool at_end () {
+            uint8_t b;
+            return !byte (b) && !std::ferror (fp);
+        }
+    };
+
+    // decode the entry of key with n_cells cells from r, calling
+    // value (v) for each non-zero cell and zeros (n) for each run of
+    // zero cells. False, maybe part way, if the entry is not that
+    static bool decode (entry_reader &r,
+                        const std::string &key,
+                        size_t n_cells,
+                        const std::function<void (int)> &value,
+                        const std::function<void (size_t)> &zeros) {
+        uint8_t b;
+        for (char m : CACHE_MAGIC) {
+            if (!r.byte (b) || b != static_cast<uint8_t> (m))
+                return false;
+        }
+        uint64_t v;
+        if (!r.le (v, 4) || v != key.size())
+            return false;
+        for (char k : key) {
+            if (!r.byte (b) || b != static_cast<uint8_t> (k))
+                return false;
+        }
+        if (!r.le (v, 8) || v != n_cells)
+            return false;
+        size_t c = 0;
+        while (c < n_cells) {
+            if (!r.varint (v))
+                return false;
+            if (v == 0) {
+                if (!r.varint (v) || v == 0 || v > n_cells - c)
+                    return false;
+                zeros (static_cast<size_t> (v));
+                c += static_cast<size_t> (v);
+            } else {
+                // undo the zigzag
+                auto half = static_cast<int64_t> (v >> 1);
+                value (static_cast<int> (
+                    half ^ -static_cast<int64_t> (v & 1)));
+                ++c;
+            }
+        }
+        return r.at_end();
+    }
+
+    // unique per process and thread, renamed into place whole
+    static std::filesystem::path
+    tmp_path (const std::filesystem::path &path) {
+        std::filesystem::path tmp = path;
+        tmp += "." + std::to_string (getpid()) + "." +
+            std::to_string (std::hash<std::thread::id>{}(
+                std::this_thread::get_id())) +
+            ".tmp";
+        return tmp;
+    }
+
+    // once the directory outgrows the bound, remove least recently
+    // used entries; note its size either way
+    void evict () {
+        namespace fs = std::filesystem;
+        struct entry {
+            fs::file_time_type used;
+            uintmax_t size;
+            fs::path path;
+        };
+        std::vector<entry> entries;
+        uintmax_t total = 0;
+        std::error_code ec;
+        for (const auto &de : fs::directory_iterator (dir, ec)) {
+            if (de.path().extension() != CACHE_SUFFIX)
+                continue;
+            std::error_code e2;
+            uintmax_t size = de.file_size (e2);
+            auto used = de.last_write_time (e2);
+            if (e2)
+                continue; // removed meanwhile
+            entries.push_back ({used, size, de.path()});
+            total += size;
+        }
+        if (total > max_bytes) {
+            // down to 90% of the bound, so a full cache is not
+            // scanned again on every store
+            uint64_t target = max_bytes - max_bytes / 10;
+            std::sort (entries.begin(), entries.end(),
+                       [] (const entry &a, const entry &b) {
+                           return a.used < b.used;
+                       });
+            for (const entry &e : entries) {
+                if (total <= target)
+                    break;
+                fs::remove (e.path, ec);
+                total -= e.size;
+            }
+        }
+        used_estimate = total;
+    }
+
+  public:
+    ResultCache (const std::string &cache_dir,
+                 uint64_t max_mib = CACHE_DEFAULT_MIB)
+        : dir (cache_dir),
+          max_bytes (max_mib << 20) {
+        std::error_code ec;
+        std::filesystem::create_directories (dir, ec);
+        if (ec || !std::filesystem::is_directory (dir)) {
+            throw std::runtime_error (
+                "failed to create cache directory " + cache_dir);
+        }
+    }
+
+    // an entry written as its cells are counted, so a region's counts
+    // need not be held whole. Cells are encoded as they are put and
+    // written to a temporary file, renamed into place by commit(). An
+    // entry outgrowing the cache's bound, or any failure to write, is
+    // abandoned, as is one never committed
+    class Writer {
+      private:
+        ResultCache *cache;
+        std::filesystem::path path;
+        std::filesystem::path tmp;
+        FILE *fp = NULL;
+        size_t n_cells;
+        size_t n_put = 0;
+        uint64_t zero_run = 0;
+        uint64_t n_bytes = 0;
+        std::string buf;
+
+        void write_buf () {
+            n_bytes += buf.size();
+            if (n_bytes > cache->max_bytes ||
+                std::fwrite (buf.data(), 1, buf.size(), fp) !=
+                    buf.size()) {
+                abandon();
+                return;
+            }
+            buf.clear();
+        }
+
+        void abandon () {
+            if (fp == NULL)
+                return;
+            std::fclose (fp);
+            fp = NULL;
+            std::error_code ec;
+            std::filesystem::remove (tmp, ec);
+        }
+
+      public:
+        Writer (ResultCache &cache_,
+                const std::string &key,
+                size_t n_cells_)
+            : cache (&cache_),
+              n_cells (n_cells_) {
+            if (key.empty())
+                return;
+            path = cache->entry_path (key);
+            tmp = tmp_path (path);
+            fp = std::fopen (tmp.c_str(), "wb");
+            if (fp == NULL)
+                return;
+            buf.assign (CACHE_MAGIC, 8);
+            put_le (buf, key.size(), 4);
+            buf += key;
+            put_le (buf, n_cells, 8);
+        }
+
+        Writer (const Writer &) = delete;
+        Writer &operator= (const Writer &) = delete;
+
+        ~Writer () { abandon(); }
+
+        // whether the entry is still being written
+        bool ok () const noexcept { return fp != NULL; }
+
+        // the next n cells of the entry
+        void put (const int *cells,
+                  size_t n) {
+            if (fp == NULL)
+                return;
+            if (n > n_cells - n_put) {
+                abandon();
+                return;
+            }
+            n_put += n;
+            for (size_t c = 0; c < n; ++c) {
+                if (cells[c] == 0) {
+                    ++zero_run;
+                    continue;
+                }
+                if (zero_run) {
+                    put_varint (buf, 0);
+                    put_varint (buf, zero_run);
+                    zero_run = 0;
+                }
+                auto v = static_cast<int64_t> (cells[c]);
+                put_varint (buf, (static_cast<uint64_t> (v) << 1) ^
+                                     static_cast<uint64_t> (v >> 63));
+                if (buf.size() >= (1 << 16)) {
+                    write_buf();
+                    if (fp == NULL)
+                        return;
+                }
+            }
+        }
+
+        // rename the entry into place once every cell is put,
+        // evicting as needed. The cache is only an aid, so failing
+        // to write is not an error
+        bool commit () {
+            if (fp == NULL)
+                return false;
+            if (n_put != n_cells) {
+                abandon();
+                return false;
+            }
+            if (zero_run) {
+                put_varint (buf, 0);
+                put_varint (buf, zero_run);
+                zero_run = 0;
+            }
+            write_buf();
+            if (fp == NULL)
+                return false;
+            bool closed = std::fclose (fp) == 0;
+            fp = NULL;
+            std::error_code ec;
+            if (closed)
+                std::filesystem::rename (tmp, path, ec);
+            if (!closed || ec) {
+                std::filesystem::remove (tmp, ec);
+                return false;
+            }
+            // scan the directory only when it may have outgrown the
+            // bound
+            if (cache->used_estimate != UINT64_MAX)
+                cache->used_estimate += n_bytes;
+            if (cache->used_estimate == UINT64_MAX ||
+                cache->used_estimate > cache->max_bytes)
+                cache->evict();
+            return true;
+        }
+    };
+
+    // hand the n_cells cells stored under key to fn (first_cell,
+    // cells, n) in blocks of up to block_cells, if there is such an
+    // entry. The entry is checked whole before any cell is handed
+    // over, so a damaged, colliding or differently sized entry is a
+    // miss with nothing handed over
+    bool replay (const std::string &key,
+                 size_t n_cells,
+                 const std::function<void (size_t, const int *, size_t)>
+                     &fn,
+                 size_t block_cells = 1 << 20) const {
+        if (key.empty())
+            return false;
+        std::filesystem::path path = entry_path (key);
+        FILE *fp = std::fopen (path.c_str(), "rb");
+        if (fp == NULL)
+            return false;
+        auto r = std::make_unique<entry_reader>();
+        r->fp = fp;
+        bool hit = decode (*r, key, n_cells, [] (int) {}, [] (size_t) {});
+        if (hit) {
+            std::rewind (fp);
+            r->at = r->len = 0;
+            std::vector<int> block (
+                std::max<size_t> (1, std::min (block_cells, n_cells)), 0);
+            size_t first = 0, filled = 0;
+            auto flush = [&] () {
+                fn (first, block.data(), filled);
+                std::fill_n (block.begin(), filled, 0);
+                first += filled;
+                filled = 0;
+            };
+            try {
+                hit = decode (
+                    *r, key, n_cells,
+                    [&] (int v) {
+                        block[filled++] = v;
+                        if (filled == block.size())
+                            flush();
+                    },
+                    [&] (size_t n) {
+                        // already zero
+                        while (n > 0) {
+                            size_t take =
+                                std::min (n, block.size() - filled);
+                            filled += take;
+                            n -= take;
+                            if (filled == block.size())
+                                flush();
+                        }
+                    });
+            } catch (...) {
+                std::fclose (fp);
+                throw;
+            }
+            if (hit && filled)
+                flush();
+        }
+        std::fclose (fp);
+        if (!hit)
+            return false;
+        // a hit makes the entry the most recently used
+        std::error_code ec;
+        std::filesystem::last_write_time (
+            path, std::filesystem::file_time_type::clock::now(), ec);
+        return true;
+    }
+
+    // the n_cells cells stored under key, if any (see replay)
+    bool load (const std::string &key,
+               size_t n_cells,
+               std::vector<int> &cells) const {
+        std::vector<int> got (n_cells, 0);
+        bool hit = replay (key, n_cells,
+                           [&got] (size_t first, const int *block,
+                                   size_t n) {
+                               std::copy_n (block, n,
+                                            got.begin() +
+                                                static_cast<std::ptrdiff_t> (
+                                                    first));
+                           });
+        if (hit)
+            cells = std::move (got);
+        return hit;
+    }
+
+    // store n_cells cells under key, evicting as needed (see Writer)
+    bool store (const std::string &key,
+                const int *cells,
+                size_t n_cells) {
+        Writer w (*this, key, n_cells);
+        w.put (cells, n_cells);
+        return w.commit();
+    }
+};
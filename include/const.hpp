@@ -35,6 +35,11 @@ inline constexpr size_t RSTRAND_OFFSET = N_FIELDS_PER_STRAND;
 inline constexpr uint8_t UNDEFINED_VALUE = UINT8_MAX;
 
 inline constexpr std::string_view VERSION = "0.0.1";
+// what counts mean, independent of VERSION. Bump it with any change
+// that alters a count for the same input and parameters (such as
+// how overlapping mates are resolved): results cached by earlier
+// builds (see cache.hpp) are then no longer used
+inline constexpr uint8_t COUNTS_VERSION = 2;
 inline constexpr std::string_view HEADER =
     "A,T,C,G,-,N,FINS,FDEL,HEAD,TAIL,QUALSUM,READ,a,t,c,g,_,n,fins,fdel,head,"
     "tail,qualsum,read";
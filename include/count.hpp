@@ -5,16 +5,37 @@
 
 #pragma once
 
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
 #include "bounds.hpp"
+#include "downsample.hpp"
 #include "pileup.hpp"
+#include "point.hpp"
+#include "stats.hpp"
 #include "structs.hpp"
 
 // nothing but C please
 extern "C" {
+// optional observer of every read the iterator yields
+struct fetch_hook {
+    void (*fn) (void *ctx, const bam1_t *b) = NULL;
+    void *ctx = NULL;
+};
 struct pf_capture {
     htsFile *fh = NULL; // since nullptr is c++
-    hts_itr_t *it = NULL;
+    hts_itr_t *it = NULL; // NULL reads the file sequentially
     const count_params *p = NULL;
+    ReadMetaCache *reads = NULL;
+    fetch_hook on_fetch;
+    sam_hdr_t *head = NULL; // needed to read sequentially
+    read_tally *tally = NULL; // only when gathering statistics
 };
 inline int pileup_func (void *data,
                         bam1_t *b) {
@@ -22,67 +43,593 @@ inline int pileup_func (void *data,
     int ret;
     // find the next good read
     while (1) {
-        ret = sam_itr_next (d->fh, d->it, b);
+        ret = d->it ? sam_itr_next (d->fh, d->it, b)
+                    : sam_read1 (d->fh, d->head, b);
         if (ret < 0) {
             break; // EOF/err
         }
+        if (d->on_fetch.fn)
+            d->on_fetch.fn (d->on_fetch.ctx, b);
+        if (d->tally)
+            tally_read (*d->tally, b, *d->p);
         if (!(b->core.flag & d->p->exclude_flag) &&
             ((b->core.flag & d->p->include_flag) ==
              d->p->include_flag) &&
             b->core.qual >= d->p->min_mapq) {
-            break; // found good read
+            if (!downsampled_out (b, *d->p))
+                break; // found good read
+            if (d->tally)
+                ++d->tally->rejected_downsample;
         };
     }
     return ret;
 };
+
+// fill the per-read cache as each read enters the pileup
+inline int pileup_construct (void *data,
+                             const bam1_t *b,
+                             bam_pileup_cd *cd) {
+    pf_capture *d = static_cast<pf_capture *> (data);
+    try {
+        cd->p = d->reads->acquire (b);
+    } catch (...) {
+        return -1; // don't unwind through htslib
+    }
+    return 0;
+}
+
+inline int pileup_destruct (void *data,
+                            const bam1_t *b,
+                            bam_pileup_cd *cd) {
+    pf_capture *d = static_cast<pf_capture *> (data);
+    try {
+        d->reads->release (b, static_cast<ReadMeta *> (cd->p));
+    } catch (...) {
+        return -1;
+    }
+    cd->p = NULL;
+    return 0;
+}
 }
 // end nothing but C
 
-// bam2R
-// NOTE: does not at present include the max_mismatches functionality
-// added to recent versions of deepsnv
-inline void count (htsFile *aln_fh,
-                   hts_idx_t *aln_idx,
-                   AlleleEventCounter ctr,
-                   const hts_region reg,
-                   const count_params params) {
-    bam_plp_t buf = nullptr;
-    bam1_t *b = nullptr;
+// params with any downsample_depth resolved for reg: keep_below is
+// set to keep the fraction of templates bringing the deepest column
+// of reg (among reads passing the filters) down to that depth. This
+// reads the region's records an extra time, without piling them up;
+// the time and the reads decoded are reported apart (see run_stats).
+// Already resolved params are returned as they are, so resolve once
+// where one fraction should serve several passes
+inline count_params downsample_params (htsFile *aln_fh,
+                                       hts_idx_t *aln_idx,
+                                       const hts_region reg,
+                                       const count_params &params) {
+    if (params.downsample_depth <= 0)
+        return params;
+    stage_timer timer (params.stats ? &params.stats->ns_depth_scan
+                                    : NULL);
+    uint64_t scanned = 0;
+    hts_itr_t *iter =
+        sam_itr_queryi (aln_idx, reg.rid, reg.start, reg.end);
+    if (iter == NULL) {
+        throw std::runtime_error ("failed to query index for region");
+    }
+    bam1_t *b = bam_init1();
+    // ends of the reads covering the latest start, soonest first
+    std::priority_queue<int64_t, std::vector<int64_t>,
+                        std::greater<int64_t>>
+        ends;
+    size_t max_depth = 0;
+    int ret;
+    while (b && (ret = sam_itr_next (aln_fh, iter, b)) >= 0) {
+        ++scanned;
+        const bam1_core_t &c = b->core;
+        if ((c.flag & BAM_FUNMAP) || (c.flag & params.exclude_flag) ||
+            (c.flag & params.include_flag) != params.include_flag ||
+            c.qual < params.min_mapq)
+            continue;
+        int64_t start = std::max<int64_t> (c.pos, reg.start);
+        while (!ends.empty() && ends.top() <= start)
+            ends.pop();
+        ends.push (std::min<int64_t> (bam_endpos (b), reg.end));
+        max_depth = std::max (max_depth, ends.size());
+    }
+    bool failed = b == NULL || ret < -1;
+    if (b)
+        bam_destroy1 (b);
+    sam_itr_destroy (iter);
+    if (params.stats)
+        params.stats->reads_depth_scanned += scanned;
+    if (failed) {
+        throw std::runtime_error ("failed to read alignments");
+    }
 
-    safe_size_opts sso_plp_pos;
-    sso_plp_pos.msg = "error translating htslib pileup position into "
-                      "appropriate index for results array";
+    count_params resolved = params;
+    resolved.downsample_depth = 0;
+    if (max_depth > static_cast<size_t> (params.downsample_depth)) {
+        resolved.keep_below = keep_threshold (
+            static_cast<double> (params.downsample_depth) /
+            static_cast<double> (max_depth));
+    }
+    return resolved;
+}
 
+// pileup over the reads pileup_func yields for pfc, with per-read
+// metadata cached in pfc.reads. Caller destroys
+inline bam_plp_t init_pileup (pf_capture &pfc) {
+    bam_plp_t buf = bam_plp_init (pileup_func, &pfc);
+    bam_plp_constructor (buf, pileup_construct);
+    bam_plp_destructor (buf, pileup_destruct);
+    bam_plp_set_maxcnt (buf, pfc.p->max_depth);
+    return buf;
+}
+
+// pileup the reads overlapping reg, handing each column inside reg
+// to on_column (pileup, offset of the column from reg.start, depth)
+template <typename F>
+inline void pileup_region (htsFile *aln_fh,
+                           hts_idx_t *aln_idx,
+                           const hts_region reg,
+                           const count_params &params,
+                           bool pair_mates,
+                           F &&on_column,
+                           const fetch_hook &hook = {}) {
     // fetch a read overlapping the query region;
     // then do a pileup per base for the total region
     // covered by the retrieved read;
     // then count events on those pileups which overlap
     // the original query region.
+    read_tally tally;
+    read_tally *t = params.stats ? &tally : NULL;
+    const count_params sampled =
+        downsample_params (aln_fh, aln_idx, reg, params);
+    uint64_t mark = t ? stats_now_ns() : 0;
     hts_itr_t *iter =
         sam_itr_queryi (aln_idx, reg.rid, reg.start, reg.end);
+    if (iter == NULL) {
+        throw std::runtime_error ("failed to query index for region");
+    }
+    if (t)
+        t->lap (t->ns_query, mark);
 
-    pf_capture pfc{aln_fh, iter, &params};
-    buf = bam_plp_init (pileup_func,
-                        &pfc); // initialize pileup
-    bam_plp_set_maxcnt (buf, params.max_depth);
-
-    int64_t plp_pos = -1;
-    int plp_tid = -1, n_plp = -1;
-    const bam_pileup1_t *pl = nullptr;
-    size_t pos_offset;
-    while ((pl = bam_plp64_auto (buf, &plp_tid, &plp_pos, &n_plp)) !=
-           0) {
-        if (n_plp < 0 || plp_tid < 0 || plp_pos < 0) {
-            throw std::runtime_error ("pileup failed");
+    ReadMetaCache reads (pair_mates);
+    pf_capture pfc{aln_fh, iter, &sampled, &reads, hook, NULL, t};
+    bam_plp_t buf = init_pileup (pfc);
+
+    try {
+        int64_t plp_pos = -1;
+        int plp_tid = -1, n_plp = -1;
+        const bam_pileup1_t *pl = nullptr;
+        size_t pos_offset;
+        while ((pl = bam_plp64_auto (buf, &plp_tid, &plp_pos,
+                                     &n_plp)) != 0) {
+            if (n_plp < 0 || plp_tid < 0 || plp_pos < 0) {
+                throw std::runtime_error ("pileup failed");
+            }
+            if (t)
+                t->lap (t->ns_pileup, mark);
+            if (!(plp_pos >= reg.start && plp_pos < reg.end)) {
+                if (t)
+                    ++t->columns_out;
+                continue;
+            }
+            // in range and non-negative, as checked above
+            pos_offset = hot_bounds::size (
+                plp_pos - reg.start,
+                "error translating htslib pileup position into "
+                "appropriate index for results array");
+            on_column (pl, pos_offset,
+                       hot_bounds::size (n_plp, "pileup depth"));
+            if (t) {
+                ++t->columns_in;
+                t->columns_max_depth += n_plp >= params.max_depth;
+                t->lap (t->ns_count, mark);
+            }
         }
-        if (!(plp_pos >= reg.start && plp_pos < reg.end)) {
-            continue;
+        if (n_plp < 0) {
+            throw std::runtime_error ("pileup failed");
         }
-        pos_offset = safe_size (plp_pos - reg.start, sso_plp_pos);
-        ctr.count_pileup (pl, pos_offset, safe_size (n_plp));
+    } catch (...) {
+        bam_plp_destroy (buf);
+        sam_itr_destroy (iter);
+        throw;
     }
 
+    bam_plp_destroy (buf);
     sam_itr_destroy (iter);
-    bam_destroy1 (b);
+    if (t) {
+        t->lap (t->ns_pileup, mark);
+        params.stats->add (tally);
+    }
+}
+
+// pileup every read of the file in file order, without an index,
+// handing each column to on_column (pileup, tid, pos, depth). The
+// file must be coordinate sorted and positioned after its header; it
+// may be a stream such as stdin
+template <typename F>
+inline void pileup_file (htsFile *aln_fh,
+                         sam_hdr_t *head,
+                         const count_params &params,
+                         bool pair_mates,
+                         F &&on_column) {
+    read_tally tally;
+    read_tally *t = params.stats ? &tally : NULL;
+    uint64_t mark = t ? stats_now_ns() : 0;
+    ReadMetaCache reads (pair_mates);
+    pf_capture pfc{aln_fh, NULL, &params, &reads, {}, head, t};
+    bam_plp_t buf = init_pileup (pfc);
+
+    try {
+        int64_t plp_pos = -1;
+        int plp_tid = -1, n_plp = -1;
+        const bam_pileup1_t *pl = nullptr;
+        while ((pl = bam_plp64_auto (buf, &plp_tid, &plp_pos,
+                                     &n_plp)) != 0) {
+            if (n_plp < 0 || plp_tid < 0 || plp_pos < 0) {
+                throw std::runtime_error ("pileup failed");
+            }
+            if (t)
+                t->lap (t->ns_pileup, mark);
+            on_column (pl, plp_tid, plp_pos,
+                       hot_bounds::size (n_plp, "pileup depth"));
+            if (t) {
+                ++t->columns_in;
+                t->columns_max_depth += n_plp >= params.max_depth;
+                t->lap (t->ns_count, mark);
+            }
+        }
+        if (n_plp < 0) {
+            throw std::runtime_error (
+                "pileup failed, is the input coordinate sorted?");
+        }
+    } catch (...) {
+        bam_plp_destroy (buf);
+        throw;
+    }
     bam_plp_destroy (buf);
+    if (t) {
+        t->lap (t->ns_pileup, mark);
+        params.stats->add (tally);
+    }
+}
+
+struct bam_free {
+    void operator() (bam1_t *b) const { bam_destroy1 (b); }
+};
+using bam_ptr = std::unique_ptr<bam1_t, bam_free>;
+
+// count a short region without a pileup: its reads are read once and
+// each CIGAR walked to each position (see resolve_at). Columns hold
+// the covering reads in the order fetched, as the pileup's do, so the
+// counts are the same. Returns false, having counted nothing, where
+// that is not guaranteed: a column could exceed max_depth, a CIGAR
+// would be stepped through differently, or (pairing mates) a qname is
+// shared by more than two reads. Count with the pileup then
+inline bool count_point (htsFile *aln_fh,
+                         hts_idx_t *aln_idx,
+                         AlleleEventCounter &ctr,
+                         const hts_region reg,
+                         const count_params &params) {
+    bool pair_mates = ctr.get_settings().discard_overlaps;
+    read_tally tally;
+    read_tally *t = params.stats ? &tally : NULL;
+    const count_params sampled =
+        downsample_params (aln_fh, aln_idx, reg, params);
+    uint64_t mark = t ? stats_now_ns() : 0;
+    hts_itr_t *iter =
+        sam_itr_queryi (aln_idx, reg.rid, reg.start, reg.end);
+    if (iter == NULL) {
+        throw std::runtime_error ("failed to query index for region");
+    }
+    if (t)
+        t->lap (t->ns_query, mark);
+
+    ReadMetaCache reads (pair_mates);
+    pf_capture pfc{aln_fh, iter, &sampled, &reads, {}, NULL, t};
+    std::vector<bam_ptr> fetched;
+    std::unordered_map<std::string_view, int> per_qname;
+    bool walkable = true;
+    try {
+        int ret = 0;
+        bam_ptr b (bam_init1());
+        while (b && (ret = pileup_func (&pfc, b.get())) >= 0) {
+            if (b->core.flag & BAM_FUNMAP)
+                continue; // never enters a pileup
+            if (!cigar_walkable (b.get()) ||
+                fetched.size() + 1 >=
+                    static_cast<size_t> (std::max (1, params.max_depth)) ||
+                (pair_mates &&
+                 ++per_qname[bam_get_qname (b.get())] > 2)) {
+                walkable = false;
+                break;
+            }
+            fetched.push_back (std::move (b));
+            b.reset (bam_init1());
+        }
+        if (!b)
+            throw std::bad_alloc();
+        if (walkable && ret < -1) {
+            throw std::runtime_error ("failed to read alignments");
+        }
+    } catch (...) {
+        sam_itr_destroy (iter);
+        throw;
+    }
+    sam_itr_destroy (iter);
+    if (t)
+        t->lap (t->ns_pileup, mark);
+    if (!walkable) {
+        // the pileup reads and counts these reads again
+        if (t)
+            params.stats->add_times (tally);
+        return false;
+    }
+
+    std::vector<ReadMeta *> metas;
+    metas.reserve (fetched.size());
+    for (const bam_ptr &b : fetched)
+        metas.push_back (reads.acquire (b.get()));
+    std::vector<bam_pileup1_t> column;
+    column.reserve (fetched.size());
+    for (int64_t pos = reg.start; pos < reg.end; ++pos) {
+        column.clear();
+        for (size_t i = 0; i < fetched.size(); ++i) {
+            bam_pileup1_t p{};
+            if (!resolve_at (fetched[i].get(), pos, p))
+                continue;
+            p.b = fetched[i].get();
+            p.cd.p = metas[i];
+            column.push_back (p);
+        }
+        if (!column.empty()) {
+            ctr.count_pileup (column.data(),
+                              static_cast<size_t> (pos - reg.start),
+                              column.size());
+            if (t)
+                ++t->columns_in;
+        }
+    }
+    for (size_t i = 0; i < fetched.size(); ++i)
+        reads.release (fetched[i].get(), metas[i]);
+    if (t) {
+        t->lap (t->ns_count, mark);
+        params.stats->add (tally);
+    }
+    return true;
+}
+
+// count reg with a pileup whatever its length, params having any
+// downsample_depth resolved (see downsample_params)
+inline void count_by_pileup (htsFile *aln_fh,
+                             hts_idx_t *aln_idx,
+                             AlleleEventCounter &ctr,
+                             const hts_region reg,
+                             const count_params &params) {
+    // one variant of the counter for the whole region
+    ctr.with_variant ([&] (auto overlaps, auto clip) {
+        constexpr bool O = decltype (overlaps)::value;
+        constexpr bool C = decltype (clip)::value;
+        pileup_region (aln_fh, aln_idx, reg, params, O,
+                       [&ctr] (const bam_pileup1_t *pl,
+                               size_t pos_offset, size_t n_plp) {
+                           ctr.count_pileup_as<O, C> (pl, pos_offset,
+                                                      n_plp);
+                       });
+    });
+}
+
+// bam2R
+// NOTE: does not at present include the max_mismatches functionality
+// added to recent versions of deepsnv
+inline void count (htsFile *aln_fh,
+                   hts_idx_t *aln_idx,
+                   AlleleEventCounter ctr,
+                   const hts_region reg,
+                   const count_params params) {
+    // once, for the short path and any fallback to the pileup
+    const count_params sampled =
+        downsample_params (aln_fh, aln_idx, reg, params);
+    if (reg.rlen <= POINT_QUERY_MAX_LEN &&
+        count_point (aln_fh, aln_idx, ctr, reg, sampled))
+        return;
+    count_by_pileup (aln_fh, aln_idx, ctr, reg, sampled);
+}
+
+// completed rows of counts, in position order. rows[0] is the row
+// first_row positions after reg.start
+using row_sink = std::function<void (size_t first_row,
+                                     const int *rows,
+                                     size_t n_rows)>;
+
+// hands out n_cells zeroed cells for a whole result, so callers such
+// as language bindings can have counts written straight into memory
+// they own
+using cell_alloc = std::function<int *(size_t n_cells)>;
+
+// which rows the counting pipeline hands on
+enum class RowFilter {
+    all, // every position of the region
+    covered, // positions with at least one read on either strand
+    variant, // positions with evidence beyond the majority allele
+};
+
+inline bool row_kept (RowFilter filter,
+                      const int *row) {
+    switch (filter) {
+        case RowFilter::all:
+            return true;
+        case RowFilter::covered:
+            return row[FIELD_NOBS] + row[RSTRAND_OFFSET + FIELD_NOBS] >
+                0;
+        case RowFilter::variant: {
+            // alleles are bases and deletions; an insertion after
+            // the base is evidence by itself
+            constexpr uint8_t alleles[] = {FIELD_A, FIELD_T, FIELD_C,
+                                           FIELD_G, FIELD_IS_DEL};
+            int total = 0, majority = 0;
+            for (uint8_t f : alleles) {
+                int n = row[f] + row[RSTRAND_OFFSET + f];
+                total += n;
+                majority = std::max (majority, n);
+            }
+            int ins = row[FIELD_FINS] + row[RSTRAND_OFFSET + FIELD_FINS];
+            return total - majority + ins > 0;
+        }
+    }
+    return true;
+}
+
+// hand the rows of a block that pass filter on to sink, as runs of
+// consecutive rows
+inline void sink_filtered (RowFilter filter,
+                           const row_sink &sink,
+                           size_t first_row,
+                           const int *rows,
+                           size_t n_rows) {
+    if (filter == RowFilter::all) {
+        sink (first_row, rows, n_rows);
+        return;
+    }
+    size_t r = 0;
+    while (r < n_rows) {
+        while (r < n_rows && !row_kept (filter, rows + r * N_FIELDS_PER_OBS))
+            ++r;
+        size_t run_start = r;
+        while (r < n_rows && row_kept (filter, rows + r * N_FIELDS_PER_OBS))
+            ++r;
+        if (r > run_start) {
+            sink (first_row + run_start,
+                  rows + run_start * N_FIELDS_PER_OBS, r - run_start);
+        }
+    }
+}
+
+inline constexpr size_t STREAM_WINDOW_ROWS = 1 << 16;
+
+// count(), holding only a window of rows rather than the whole
+// region. The pileup visits columns in order and a column is complete
+// once visited, so whenever the pileup moves past the window it is
+// handed to sink (uncovered positions as zero rows) and reused.
+// Memory is then bounded by the pileup itself (read length x depth)
+// and the window, whatever the region length.
+//
+// Rows failing filter are dropped here, before they are formatted;
+// with a filter, stretches without reads are skipped outright
+inline void count_streaming (htsFile *aln_fh,
+                             hts_idx_t *aln_idx,
+                             const hts_region reg,
+                             const count_params params,
+                             const AEVSettings settings,
+                             const row_sink &sink,
+                             RowFilter filter = RowFilter::all,
+                             size_t window_rows = STREAM_WINDOW_ROWS,
+                             const fetch_hook &hook = {}) {
+    const count_params sampled =
+        downsample_params (aln_fh, aln_idx, reg, params);
+    window_rows = std::max<size_t> (1, std::min (window_rows, reg.rlen));
+    std::vector<int> window (window_rows * N_FIELDS_PER_OBS, 0);
+    AlleleEventCounter ctr (sampled, window, settings);
+    // a hook would see the reads twice should the short path fall back
+    if (reg.rlen <= std::min (POINT_QUERY_MAX_LEN, window_rows) &&
+        !hook.fn && count_point (aln_fh, aln_idx, ctr, reg, sampled)) {
+        sink_filtered (filter, sink, 0, window.data(), reg.rlen);
+        return;
+    }
+
+    size_t window_start = 0; // row offset of window[0]
+    bool touched = false; // any column counted into the window
+    auto flush = [&] (size_t n_rows) {
+        if (touched || filter == RowFilter::all) {
+            sink_filtered (filter, sink, window_start, window.data(),
+                           n_rows);
+        }
+        if (touched) {
+            std::fill_n (window.begin(), n_rows * N_FIELDS_PER_OBS, 0);
+            touched = false;
+        }
+        window_start += n_rows;
+    };
+
+    ctr.with_variant ([&] (auto overlaps, auto clip) {
+        constexpr bool O = decltype (overlaps)::value;
+        constexpr bool C = decltype (clip)::value;
+        pileup_region (
+            aln_fh, aln_idx, reg, sampled, O,
+            [&] (const bam_pileup1_t *pl, size_t pos_offset,
+                 size_t n_plp) {
+                if (pos_offset >= window_start + window_rows) {
+                    flush (window_rows);
+                    if (filter != RowFilter::all)
+                        window_start = pos_offset;
+                }
+                while (pos_offset >= window_start + window_rows)
+                    flush (window_rows);
+                ctr.count_pileup_as<O, C> (
+                    pl, pos_offset - window_start, n_plp);
+                touched = true;
+            },
+            hook);
+    });
+    if (filter != RowFilter::all) {
+        if (touched)
+            flush (std::min (window_rows, reg.rlen - window_start));
+        return;
+    }
+    while (window_start < reg.rlen)
+        flush (std::min (window_rows, reg.rlen - window_start));
+}
+
+// rows at arbitrary positions, row i being at 0-based pos[i] of
+// contig tids[i]
+using located_sink = std::function<void (const int32_t *tids,
+                                         const int64_t *pos,
+                                         const int *rows,
+                                         size_t n_rows)>;
+
+// count every position the reads of a whole file cover, in one linear
+// pass without an index. Rows passing filter are gathered into blocks
+// of block_rows and handed to sink, so memory is bounded by the
+// pileup and the block whatever the size of the file
+inline void count_file_streaming (htsFile *aln_fh,
+                                  sam_hdr_t *head,
+                                  const count_params params,
+                                  const AEVSettings settings,
+                                  const located_sink &sink,
+                                  RowFilter filter = RowFilter::all,
+                                  size_t block_rows =
+                                      STREAM_WINDOW_ROWS) {
+    block_rows = std::max<size_t> (1, block_rows);
+    std::vector<int> block (block_rows * N_FIELDS_PER_OBS, 0);
+    std::vector<int32_t> tids (block_rows);
+    std::vector<int64_t> pos (block_rows);
+    AlleleEventCounter ctr (params, block, settings);
+    size_t n = 0;
+    auto flush = [&] () {
+        sink (tids.data(), pos.data(), block.data(), n);
+        std::fill_n (block.begin(), n * N_FIELDS_PER_OBS, 0);
+        n = 0;
+    };
+
+    ctr.with_variant ([&] (auto overlaps, auto clip) {
+        constexpr bool O = decltype (overlaps)::value;
+        constexpr bool C = decltype (clip)::value;
+        pileup_file (aln_fh, head, params, O,
+                     [&] (const bam_pileup1_t *pl, int tid, int64_t p,
+                          size_t n_plp) {
+                         ctr.count_pileup_as<O, C> (pl, n, n_plp);
+                         int *row =
+                             block.data() + n * N_FIELDS_PER_OBS;
+                         if (!row_kept (filter, row)) {
+                             std::fill_n (row, N_FIELDS_PER_OBS, 0);
+                             return;
+                         }
+                         tids[n] = tid;
+                         pos[n] = p;
+                         if (++n == block_rows)
+                             flush();
+                     });
+    });
+    if (n)
+        flush();
 }
@@ -0,0 +1,50 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <cstdint>
+#include <htslib/sam.h>
+
+#include "pileup.hpp"
+
+// Reads are downsampled by a hash of their qname rather than by
+// arrival order, so every region and every run with the same seed
+// keeps the same templates, mates are kept or dropped together, and
+// which reads survive is unrelated to where they start
+
+// FNV-1a over the qname, finished with the splitmix64 mixer so
+// nearby seeds give unrelated selections
+inline uint64_t qname_hash (const char *qname,
+                            uint64_t seed) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *c = qname; *c; ++c) {
+        h ^= static_cast<uint8_t> (*c);
+        h *= 1099511628211ULL;
+    }
+    h ^= seed + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// the keep_below keeping fraction of templates
+inline uint64_t keep_threshold (double fraction) {
+    if (!(fraction < 1.0))
+        return UINT64_MAX;
+    if (fraction <= 0.0)
+        return 0;
+    double below = fraction * 18446744073709551616.0; // 2^64
+    if (below >= 18446744073709551616.0)
+        return UINT64_MAX - 1;
+    return static_cast<uint64_t> (below);
+}
+
+inline bool downsampled_out (const bam1_t *b,
+                             const count_params &p) {
+    return p.keep_below != UINT64_MAX &&
+        qname_hash (bam_get_qname (b), p.downsample_seed) >=
+        p.keep_below;
+}
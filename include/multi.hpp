@@ -0,0 +1,340 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aln.hpp"
+#include "const.hpp"
+#include "count.hpp"
+#include "parallel.hpp"
+#include "regions.hpp"
+#include "structs.hpp"
+
+// run fn (i, worker) for i in [0, n) on up to n_threads threads, each
+// taking the next unclaimed i. worker numbers the calling thread from
+// 0, for per-thread state. Rethrows the first error once all joined
+template <typename F>
+inline void parallel_for (size_t n,
+                          size_t n_threads,
+                          F &&fn) {
+    n_threads = std::max<size_t> (1, std::min (n_threads, n));
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::vector<std::exception_ptr> errors (n_threads);
+    auto work = [&] (size_t t) {
+        try {
+            for (size_t i = next++; i < n && !failed; i = next++)
+                fn (i, t);
+        } catch (...) {
+            errors[t] = std::current_exception();
+            failed = true;
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve (n_threads - 1);
+    for (size_t t = 1; t < n_threads; ++t)
+        workers.emplace_back (work, t);
+    work (0);
+    for (auto &w : workers)
+        w.join();
+
+    for (auto &e : errors) {
+        if (e)
+            std::rethrow_exception (e);
+    }
+}
+
+// alignment file paths listed one per line, skipping blanks and #
+// comments
+inline std::vector<std::string>
+read_sample_list (const std::string &path) {
+    std::ifstream in (path);
+    if (!in) {
+        throw std::runtime_error ("failed to open samples file " +
+                                  path);
+    }
+    std::vector<std::string> paths;
+    std::string line;
+    while (std::getline (in, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+        paths.push_back (line);
+    }
+    if (paths.empty()) {
+        throw std::runtime_error ("no samples found in " + path);
+    }
+    return paths;
+}
+
+// an alignment file whose header and index are loaded once for the
+// whole run and shared read-only between workers. CRAM indices are
+// bound to the handle they were loaded on so are left to workers
+class SampleSource {
+  public:
+    std::string path;
+    bam_hdr_t *head = nullptr;
+    hts_idx_t *idx = nullptr; // null for CRAM
+    bool is_cram = false;
+
+    SampleSource (const std::string &path_,
+                  const AEVSettings &settings,
+                  const aln_opts &opts)
+        : path (path_) {
+        htsFile *fh = open_alignment (path, settings, opts);
+        try {
+            head = sam_hdr_read (fh);
+            if (head == NULL) {
+                throw std::runtime_error (
+                    "failed to get header from alignment file " + path);
+            }
+            is_cram = hts_get_format (fh)->format == cram;
+            if (!is_cram) {
+                idx = sam_index_load (fh, path.c_str());
+                if (idx == NULL) {
+                    throw std::runtime_error (
+                        "failed to load index file for " + path);
+                }
+            }
+        } catch (...) {
+            if (head)
+                bam_hdr_destroy (head);
+            hts_close (fh);
+            throw;
+        }
+        hts_close (fh);
+    }
+
+    SampleSource (const SampleSource &) = delete;
+    SampleSource &operator= (const SampleSource &) = delete;
+
+    ~SampleSource () {
+        if (idx)
+            hts_idx_destroy (idx);
+        if (head)
+            bam_hdr_destroy (head);
+    }
+};
+
+// a worker's open handle, kept across work units while they are for
+// the same sample
+class SampleHandle {
+  private:
+    const SampleSource *src = nullptr;
+    AlnHandle h;
+
+  public:
+    void close () {
+        h.close();
+        src = nullptr;
+    }
+
+    void use (const SampleSource &s,
+              const AEVSettings &settings,
+              const aln_opts &opts) {
+        if (src == &s)
+            return;
+        src = nullptr;
+        h.open (s.path, s.idx, settings, opts);
+        src = &s;
+    }
+
+    htsFile *file () const noexcept { return h.file(); }
+
+    hts_idx_t *index () const noexcept { return h.index(); }
+};
+
+// counts of several samples over the same regions. counts is
+// sample-stacked: each sample's block holds rows_per_sample rows of
+// N_FIELDS_PER_OBS cells, with region i starting at row
+// region_offsets[i] of the block. regions and contigs are as parsed
+// against the first sample's header. cells points to counts, or to
+// the caller's buffer when counted into one
+struct multi_sample_counts {
+    std::vector<std::string> samples;
+    std::vector<named_region> regions;
+    std::vector<std::string> contigs;
+    std::vector<size_t> region_offsets; // plus rows_per_sample last
+    size_t rows_per_sample = 0;
+    std::vector<int> counts;
+    int *cells = nullptr;
+
+    const int *sample_rows (size_t sample) const {
+        return cells + sample * rows_per_sample * N_FIELDS_PER_OBS;
+    }
+};
+
+// samples opened for counting, with every region parsed against each
+// sample's own header. layout describes the sample-stacked result but
+// holds no counts
+struct sample_set {
+    std::vector<std::unique_ptr<SampleSource>> sources;
+    std::vector<hts_region> regions; // regions[s * n_regions + r]
+    multi_sample_counts layout;
+
+    size_t n_units () const { return regions.size(); }
+};
+
+// load the headers and indices of every sample once, in parallel on
+// up to n_workers threads, and parse the regions against each. Regions
+// may be on contigs in a different order between files, but each must
+// span the same positions in every sample. Handles are opened per
+// opts, so share its thread pool
+inline sample_set load_samples (const std::vector<std::string> &aln_paths,
+                                const std::vector<std::string> &region_strs,
+                                const AEVSettings settings,
+                                size_t n_workers,
+                                const aln_opts &opts = {}) {
+    if (aln_paths.empty())
+        throw std::invalid_argument ("count_samples - no samples");
+    if (region_strs.empty())
+        throw std::invalid_argument ("count_samples - no regions");
+
+    size_t n_samples = aln_paths.size();
+    size_t n_regions = region_strs.size();
+
+    sample_set set;
+    set.sources.resize (n_samples);
+    parallel_for (n_samples, n_workers, [&] (size_t s, size_t) {
+        set.sources[s] = std::make_unique<SampleSource> (
+            aln_paths[s], settings, opts);
+    });
+
+    set.regions.reserve (n_samples * n_regions);
+    multi_sample_counts &res = set.layout;
+    res.samples = aln_paths;
+    for (size_t s = 0; s < n_samples; ++s) {
+        for (size_t r = 0; r < n_regions; ++r) {
+            named_region nr = parse_region_line (set.sources[s]->head,
+                                                 region_strs[r]);
+            if (s == 0) {
+                res.contigs.push_back (sam_hdr_tid2name (
+                    set.sources[s]->head, nr.reg.rid));
+                res.regions.push_back (nr);
+                res.region_offsets.push_back (res.rows_per_sample);
+                res.rows_per_sample += nr.reg.rlen;
+            } else if (nr.reg.start != set.regions[r].start ||
+                       nr.reg.rlen != set.regions[r].rlen) {
+                throw std::runtime_error (
+                    "region " + region_strs[r] + " spans different " +
+                    "positions in " + aln_paths[s] + " than in " +
+                    aln_paths[0]);
+            }
+            set.regions.push_back (nr.reg);
+        }
+    }
+    res.region_offsets.push_back (res.rows_per_sample);
+    return set;
+}
+
+// count (sample, region) unit of set into rows, on handle h
+inline void count_sample_unit (const sample_set &set,
+                               size_t unit,
+                               SampleHandle &h,
+                               const count_params &params,
+                               const AEVSettings &settings,
+                               const aln_opts &opts,
+                               int *rows) {
+    size_t n_regions = set.layout.regions.size();
+    h.use (*set.sources[unit / n_regions], settings, opts);
+    AlleleEventCounter aev (params, rows, settings);
+    count (h.file(), h.index(), aev, set.regions[unit], params);
+}
+
+// count every (sample, region) pair on up to n_workers threads.
+// Sample headers and indices are loaded once, in parallel; work units
+// are then handed out sample by sample so a worker mostly reuses its
+// open handle. Regions are parsed as by load_samples. Counts go to
+// alloc's buffer if given
+inline multi_sample_counts
+count_samples (const std::vector<std::string> &aln_paths,
+               const std::vector<std::string> &region_strs,
+               const count_params params,
+               const AEVSettings settings,
+               size_t n_workers,
+               const aln_opts &opts = {},
+               const cell_alloc &alloc = {}) {
+    sample_set set =
+        load_samples (aln_paths, region_strs, settings, n_workers, opts);
+    multi_sample_counts res = std::move (set.layout);
+    size_t n_regions = res.regions.size();
+
+    safe_size_opts sso;
+    sso.msg = "error in calculating cells needed for storing result";
+    size_t n_cells =
+        safe_size (static_cast<int64_t> (res.samples.size() *
+                                         res.rows_per_sample *
+                                         N_FIELDS_PER_OBS),
+                   sso);
+    if (alloc) {
+        res.cells = alloc (n_cells);
+    } else {
+        res.counts.assign (n_cells, 0);
+        res.cells = res.counts.data();
+    }
+
+    // one handle per worker
+    std::vector<SampleHandle> handles (
+        std::max<size_t> (1, std::min (n_workers, set.n_units())));
+    parallel_for (set.n_units(), handles.size(),
+                  [&] (size_t unit, size_t worker) {
+        size_t s = unit / n_regions;
+        size_t r = unit % n_regions;
+        int *rows = res.cells +
+            (s * res.rows_per_sample + res.region_offsets[r]) *
+                N_FIELDS_PER_OBS;
+        count_sample_unit (set, unit, handles[worker], params, settings,
+                           opts, rows);
+    });
+    return res;
+}
+
+// the rows of region r of sample s, all regions[r].rlen of them
+using sample_sink =
+    std::function<void (size_t s, size_t r, const int *rows)>;
+
+// count the (sample, region) units of set on up to n_workers threads,
+// handing each to sink on the calling thread in sample then region
+// order as soon as it and those before it are counted. At most
+// 2 * n_workers units are held, the one being written included, so
+// memory is bounded by the longest regions rather than the whole
+// sample-stacked matrix. Output equals count_samples()
+inline void stream_samples (const sample_set &set,
+                            const count_params params,
+                            const AEVSettings settings,
+                            size_t n_workers,
+                            const aln_opts &opts,
+                            const sample_sink &sink) {
+    size_t n_units = set.n_units();
+    size_t n_regions = set.layout.regions.size();
+    n_workers = std::max<size_t> (1, std::min (n_workers, n_units));
+
+    std::vector<SampleHandle> handles (n_workers);
+    stream_ordered (
+        n_units, n_workers, 2 * n_workers,
+        [&] (size_t unit, size_t worker, std::vector<int> &rows) {
+            rows.assign (set.regions[unit].rlen * N_FIELDS_PER_OBS, 0);
+            count_sample_unit (set, unit, handles[worker], params,
+                               settings, opts, rows.data());
+        },
+        [&] (size_t unit, const std::vector<int> &rows) {
+            sink (unit / n_regions, unit % n_regions, rows.data());
+        });
+}
@@ -0,0 +1,399 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <htslib/bgzf.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "const.hpp"
+#include "pileup.hpp"
+
+// formats rows of counts as delimited text into a large reusable
+// buffer, written out a block at a time to a file or stdout ("-"),
+// optionally BGZF compressed
+class RowWriter {
+  private:
+    static constexpr size_t BUF_SIZE = 1 << 20;
+    // longest a number can format to (INT64_MIN) plus a delimiter
+    static constexpr size_t MAX_CELL = 21;
+
+    FILE *fp = nullptr;
+    BGZF *bgzf = nullptr;
+    char delim;
+    std::vector<char> buf;
+    size_t used = 0;
+
+    void write_out (const char *data,
+                    size_t n) {
+        bool ok = bgzf ? bgzf_write (bgzf, data, n) ==
+                static_cast<ssize_t> (n)
+                       : std::fwrite (data, 1, n, fp) == n;
+        if (!ok)
+            throw std::runtime_error ("failed to write output");
+    }
+
+    void reserve (size_t n) {
+        if (buf.size() - used < n)
+            flush();
+    }
+
+    template <typename T> void put_number (T v) {
+        auto res = std::to_chars (buf.data() + used,
+                                  buf.data() + buf.size(), v);
+        used = static_cast<size_t> (res.ptr - buf.data());
+    }
+
+  public:
+    explicit RowWriter (const std::string &path = "-",
+                        bool compress = false,
+                        char delim_ = ',')
+        : delim (delim_),
+          buf (BUF_SIZE) {
+        if (compress) {
+            bgzf = bgzf_open (path.c_str(), "w");
+            if (bgzf == NULL)
+                throw std::runtime_error ("failed to open output " +
+                                          path);
+        } else if (path == "-") {
+            fp = stdout;
+        } else {
+            fp = std::fopen (path.c_str(), "wb");
+            if (fp == NULL)
+                throw std::runtime_error ("failed to open output " +
+                                          path);
+        }
+    }
+
+    RowWriter (const RowWriter &) = delete;
+    RowWriter &operator= (const RowWriter &) = delete;
+
+    // best effort; call close() to see errors
+    ~RowWriter () {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    char delimiter () const noexcept { return delim; }
+
+    void flush () {
+        if (used) {
+            write_out (buf.data(), used);
+            used = 0;
+        }
+    }
+
+    void close () {
+        if (!fp && !bgzf)
+            return;
+        flush();
+        int ret = 0;
+        if (bgzf) {
+            ret = bgzf_close (bgzf);
+            bgzf = nullptr;
+        } else if (fp == stdout) {
+            ret = std::fflush (fp);
+            fp = nullptr;
+        } else {
+            ret = std::fclose (fp);
+            fp = nullptr;
+        }
+        if (ret != 0)
+            throw std::runtime_error ("failed to close output");
+    }
+
+    // a leading cell, followed by the delimiter
+    void cell (std::string_view s) {
+        if (s.size() + 1 > buf.size() - used) {
+            flush();
+            if (s.size() + 1 > buf.size()) {
+                write_out (s.data(), s.size());
+                write_out (&delim, 1);
+                return;
+            }
+        }
+        std::memcpy (buf.data() + used, s.data(), s.size());
+        used += s.size();
+        buf[used++] = delim;
+    }
+
+    void cell (uint64_t v) {
+        reserve (MAX_CELL);
+        put_number (v);
+        buf[used++] = delim;
+    }
+
+    // the counts of one position, ending the row
+    void counts (const int *row) {
+        reserve (N_FIELDS_PER_OBS * MAX_CELL);
+        for (size_t j = 0; j < N_FIELDS_PER_OBS - 1; ++j) {
+            put_number (row[j]);
+            buf[used++] = delim;
+        }
+        put_number (row[N_FIELDS_PER_OBS - 1]);
+        buf[used++] = '\n';
+    }
+
+    // header for the count columns, ending the row
+    void header () {
+        std::string h (HEADER);
+        for (char &c : h) {
+            if (c == ',')
+                c = delim;
+        }
+        h += '\n';
+        reserve (h.size());
+        if (h.size() > buf.size() - used) {
+            write_out (h.data(), h.size());
+            return;
+        }
+        std::memcpy (buf.data() + used, h.data(), h.size());
+        used += h.size();
+    }
+};
+
+inline std::string json_escape (std::string_view s) {
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char> (c) < 0x20) {
+                    char esc[8];
+                    std::snprintf (esc, sizeof esc, "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+// names of the count columns, as in HEADER
+inline std::vector<std::string> header_columns () {
+    std::vector<std::string> cols;
+    size_t b = 0;
+    while (b <= HEADER.size()) {
+        size_t e = HEADER.find (',', b);
+        if (e == std::string_view::npos)
+            e = HEADER.size();
+        cols.emplace_back (HEADER.substr (b, e - b));
+        b = e + 1;
+    }
+    return cols;
+}
+
+// a region as described in a binary matrix header. start and end are
+// 1-based, end-inclusive as on the command line
+struct matrix_region {
+    std::string name;
+    std::string contig;
+    int64_t start;
+    int64_t end;
+};
+
+inline constexpr char MATRIX_MAGIC[8] = {'P', 'E', 'V', 'M',
+                                         'A', 'T', '\0', '\1'};
+inline constexpr size_t MATRIX_ALIGN = 64;
+// largest value a cell holds, given in the header as max_value
+inline constexpr uint64_t MATRIX_CELL_MAX = UINT32_MAX;
+
+// JSON header of a binary matrix: cell type and range, columns, the
+// parameters counted with and the regions in row order. Dense
+// matrices have a row per position, so also carry each region's
+// offset into the matrix. Given samples, the regions repeat once per
+// sample in that order and offsets are into each sample's block of
+// rows_per_sample rows
+inline std::string
+matrix_header_json (const std::vector<std::string> &prefix_cols,
+                    const std::vector<matrix_region> &regions,
+                    const count_params &cp,
+                    const AEVSettings &settings,
+                    bool dense = true,
+                    const std::vector<std::string> &samples = {}) {
+    std::string cols;
+    for (const auto &c : prefix_cols)
+        cols += json_escape (c) + ",";
+    for (const auto &c : header_columns())
+        cols += json_escape (c) + ",";
+    cols.pop_back();
+
+    std::string regs;
+    uint64_t row_offset = 0;
+    for (const auto &r : regions) {
+        uint64_t n_rows = static_cast<uint64_t> (r.end - r.start + 1);
+        regs += "{\"name\":" + json_escape (r.name) +
+            ",\"contig\":" + json_escape (r.contig) +
+            ",\"start\":" + std::to_string (r.start) +
+            ",\"end\":" + std::to_string (r.end);
+        if (dense) {
+            regs += ",\"row_offset\":" + std::to_string (row_offset) +
+                ",\"n_rows\":" + std::to_string (n_rows);
+        }
+        regs += "},";
+        row_offset += n_rows;
+    }
+    if (!regs.empty())
+        regs.pop_back();
+
+    std::string samps;
+    if (!samples.empty()) {
+        for (const auto &sm : samples)
+            samps += json_escape (sm) + ",";
+        samps.pop_back();
+        samps = ",\"samples\":[" + samps + "]";
+        if (dense)
+            samps += ",\"rows_per_sample\":" +
+                std::to_string (row_offset);
+    }
+
+    return "{\"version\":" + json_escape (VERSION) +
+        ",\"dtype\":\"<u4\",\"max_value\":" +
+        std::to_string (MATRIX_CELL_MAX) + ",\"order\":\"C\"" +
+        ",\"dense\":" + (dense ? "true" : "false") +
+        ",\"n_cols\":" +
+        std::to_string (prefix_cols.size() + N_FIELDS_PER_OBS) +
+        ",\"columns\":[" + cols + "]" +
+        ",\"params\":{\"min_baseq\":" + std::to_string (cp.min_baseq) +
+        ",\"min_mapq\":" + std::to_string (cp.min_mapq) +
+        ",\"clip_bound\":" + std::to_string (cp.clip_bound) +
+        ",\"max_depth\":" + std::to_string (cp.max_depth) +
+        ",\"include_flag\":" + std::to_string (cp.include_flag) +
+        ",\"exclude_flag\":" + std::to_string (cp.exclude_flag) +
+        ",\"discard_overlaps\":" +
+        (settings.discard_overlaps ? "true" : "false") +
+        ",\"keep_below\":" + std::to_string (cp.keep_below) +
+        ",\"downsample_depth\":" +
+        std::to_string (cp.downsample_depth) +
+        ",\"downsample_seed\":" + std::to_string (cp.downsample_seed) +
+        "}" +
+        ",\"regions\":[" + regs + "]" + samps + "}";
+}
+
+// writes rows as a raw little-endian uint32 matrix after a small
+// header, so it can be memory mapped without parsing:
+//   8 bytes   magic "PEVMAT\0\1"
+//   4 bytes   header length n, uint32 little-endian
+//   n bytes   JSON header (see matrix_header_json), space padded so
+//             the matrix starts on a 64 byte boundary
+//   rest      rows x n_cols uint32, row-major
+// The row count follows from the file size. In numpy:
+//   np.memmap(path, "<u4", "r", offset=12 + n).reshape(-1, n_cols)
+class MatrixWriter {
+  private:
+    static constexpr size_t BUF_CELLS = 1 << 18;
+
+    FILE *fp = nullptr;
+    std::vector<uint32_t> buf;
+    size_t used = 0;
+
+    static uint32_t to_le (uint32_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return __builtin_bswap32 (v);
+#else
+        return v;
+#endif
+    }
+
+    void write_out (const void *data,
+                    size_t n) {
+        if (std::fwrite (data, 1, n, fp) != n)
+            throw std::runtime_error ("failed to write output");
+    }
+
+  public:
+    MatrixWriter (const std::string &path,
+                  std::string header_json)
+        : buf (BUF_CELLS) {
+        if (path == "-") {
+            fp = stdout;
+        } else {
+            fp = std::fopen (path.c_str(), "wb");
+            if (fp == NULL)
+                throw std::runtime_error ("failed to open output " +
+                                          path);
+        }
+        size_t fixed = sizeof MATRIX_MAGIC + sizeof (uint32_t);
+        size_t pad = (MATRIX_ALIGN -
+                      (fixed + header_json.size()) % MATRIX_ALIGN) %
+            MATRIX_ALIGN;
+        header_json.append (pad, ' ');
+        uint32_t len = to_le (static_cast<uint32_t> (header_json.size()));
+        write_out (MATRIX_MAGIC, sizeof MATRIX_MAGIC);
+        write_out (&len, sizeof len);
+        write_out (header_json.data(), header_json.size());
+    }
+
+    MatrixWriter (const MatrixWriter &) = delete;
+    MatrixWriter &operator= (const MatrixWriter &) = delete;
+
+    ~MatrixWriter () {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    void flush () {
+        if (used) {
+            write_out (buf.data(), used * sizeof (uint32_t));
+            used = 0;
+        }
+    }
+
+    void close () {
+        if (!fp)
+            return;
+        flush();
+        int ret = fp == stdout ? std::fflush (fp) : std::fclose (fp);
+        fp = nullptr;
+        if (ret != 0)
+            throw std::runtime_error ("failed to close output");
+    }
+
+    // a leading column value. Cells are uint32, so a value that does
+    // not fit (a position past 2^32 - 1) is an error rather than
+    // wrapped
+    void cell (uint64_t v) {
+        if (v > MATRIX_CELL_MAX) {
+            throw std::runtime_error (
+                "value " + std::to_string (v) +
+                " too large for the binary matrix, whose cells are "
+                "uint32");
+        }
+        if (used == buf.size())
+            flush();
+        buf[used++] = to_le (static_cast<uint32_t> (v));
+    }
+
+    // the counts of one position, ending the row
+    void counts (const int *row) {
+        if (buf.size() - used < N_FIELDS_PER_OBS)
+            flush();
+        for (size_t j = 0; j < N_FIELDS_PER_OBS; ++j)
+            buf[used++] = to_le (static_cast<uint32_t> (row[j]));
+    }
+};
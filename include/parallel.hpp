@@ -0,0 +1,310 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aln.hpp"
+#include "const.hpp"
+#include "count.hpp"
+#include "structs.hpp"
+
+// split reg into at most n_shards contiguous, non-overlapping
+// pieces of near equal length that together cover reg exactly
+inline std::vector<hts_region> shard_region (const hts_region &reg,
+                                             size_t n_shards) {
+    n_shards = std::max<size_t> (1, std::min (n_shards, reg.rlen));
+    std::vector<hts_region> shards;
+    shards.reserve (n_shards);
+    size_t base = reg.rlen / n_shards;
+    size_t extra = reg.rlen % n_shards;
+    int64_t start = reg.start;
+    for (size_t i = 0; i < n_shards; ++i) {
+        size_t len = base + (i < extra ? 1 : 0);
+        shards.push_back (hts_region::by_len (reg.rid, start, len));
+        start += static_cast<int64_t> (len);
+    }
+    return shards;
+}
+
+// an alignment file opened for counting, with its header read. The
+// index is shared for BAM; CRAM indices are bound to the handle they
+// were loaded on so those are loaded per handle
+class AlnHandle {
+  private:
+    htsFile *fh = nullptr;
+    bam_hdr_t *head = nullptr;
+    hts_idx_t *shared_idx = nullptr;
+    hts_idx_t *own_idx = nullptr;
+
+  public:
+    AlnHandle () = default;
+    AlnHandle (const AlnHandle &) = delete;
+    AlnHandle &operator= (const AlnHandle &) = delete;
+
+    ~AlnHandle () { close(); }
+
+    void close () {
+        if (own_idx)
+            hts_idx_destroy (own_idx);
+        if (head)
+            bam_hdr_destroy (head);
+        if (fh)
+            hts_close (fh);
+        own_idx = nullptr;
+        head = nullptr;
+        fh = nullptr;
+        shared_idx = nullptr;
+    }
+
+    void open (const std::string &path,
+               hts_idx_t *idx,
+               const AEVSettings &settings,
+               const aln_opts &opts) {
+        close();
+        try {
+            fh = open_alignment (path, settings, opts);
+            // reading the header leaves the stream positioned as
+            // htslib expects before any iterator is created
+            head = sam_hdr_read (fh);
+            if (head == NULL) {
+                throw std::runtime_error (
+                    "failed to get header from alignment file " + path);
+            }
+            if (hts_get_format (fh)->format == cram) {
+                own_idx = sam_index_load (fh, path.c_str());
+                if (own_idx == NULL) {
+                    throw std::runtime_error (
+                        "failed to load index file for " + path);
+                }
+            }
+        } catch (...) {
+            close();
+            throw;
+        }
+        shared_idx = idx;
+    }
+
+    bool is_open () const noexcept { return fh != nullptr; }
+
+    htsFile *file () const noexcept { return fh; }
+
+    hts_idx_t *index () const noexcept {
+        return own_idx ? own_idx : shared_idx;
+    }
+};
+
+// count one shard on its own file handle
+inline void count_shard (const std::string &aln_path,
+                         hts_idx_t *shared_idx,
+                         const hts_region shard,
+                         const count_params params,
+                         const AEVSettings settings,
+                         int *shard_counts,
+                         const aln_opts &opts) {
+    AlnHandle h;
+    h.open (aln_path, shared_idx, settings, opts);
+    AlleleEventCounter aev (params, shard_counts, settings);
+    count (h.file(), h.index(), aev, shard, params);
+}
+
+// run produce (i, worker, out) for i in [0, n) on up to n_workers
+// threads, and hand each out to consume (i, out) on the calling
+// thread in order of i as soon as it and those before it are done.
+// At most ahead items are in flight, the one being consumed included,
+// and their buffers are reused, so memory is bounded by ahead of the
+// largest item. worker numbers the producing thread from 0, for
+// per-thread state. Rethrows the first error once all joined
+template <typename Produce, typename Consume>
+inline void stream_ordered (size_t n,
+                            size_t n_workers,
+                            size_t ahead,
+                            Produce &&produce,
+                            Consume &&consume) {
+    n_workers = std::max<size_t> (1, std::min (n_workers, n));
+    ahead = std::max (ahead, n_workers);
+
+    std::mutex m;
+    std::condition_variable cv;
+    // item i lives in slot i % ahead, free again once i is consumed
+    std::vector<std::vector<int>> slots (ahead);
+    std::vector<char> ready (ahead, 0);
+    size_t next = 0;     // next item to claim
+    size_t consumed = 0; // items handed to consume
+    bool failed = false;
+    std::exception_ptr error;
+    auto fail = [&] () {
+        std::lock_guard<std::mutex> lk (m);
+        if (!error)
+            error = std::current_exception();
+        failed = true;
+        cv.notify_all();
+    };
+
+    auto work = [&] (size_t t) {
+        try {
+            for (;;) {
+                size_t i;
+                {
+                    std::unique_lock<std::mutex> lk (m);
+                    cv.wait (lk, [&] {
+                        return failed || next == n ||
+                            next < consumed + ahead;
+                    });
+                    if (failed || next == n)
+                        return;
+                    i = next++;
+                }
+                produce (i, t, slots[i % ahead]);
+                std::lock_guard<std::mutex> lk (m);
+                ready[i % ahead] = 1;
+                cv.notify_all();
+            }
+        } catch (...) {
+            fail();
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve (n_workers);
+    for (size_t t = 0; t < n_workers; ++t)
+        workers.emplace_back (work, t);
+
+    try {
+        for (size_t i = 0; i < n; ++i) {
+            {
+                std::unique_lock<std::mutex> lk (m);
+                cv.wait (lk,
+                         [&] { return failed || ready[i % ahead]; });
+                if (failed)
+                    break;
+            }
+            const std::vector<int> &out = slots[i % ahead];
+            consume (i, out);
+            std::lock_guard<std::mutex> lk (m);
+            ready[i % ahead] = 0;
+            consumed = i + 1;
+            cv.notify_all();
+        }
+    } catch (...) {
+        fail();
+    }
+    for (auto &w : workers)
+        w.join();
+    if (error)
+        std::rethrow_exception (error);
+}
+
+// count reg on up to n_shards threads. result must already hold
+// reg.rlen * N_FIELDS_PER_OBS zeroed cells; each shard writes only
+// to the rows of its own positions.
+//
+// Shards query the index for their own span, so a read straddling a
+// boundary is fetched by both neighbours, but a pileup column is only
+// counted by the shard owning that position, and a column contains
+// the same reads in the same (file) order as in a serial run. Output
+// is therefore identical to count() over the whole region, with the
+// caveat that where max_depth truncates a column htslib's cutoff
+// depends on which reads have been fetched so far, and so can
+// differ near shard starts.
+//
+// Shard handles are opened per opts, so share its thread pool.
+inline void count_sharded (const std::string &aln_path,
+                           hts_idx_t *aln_idx,
+                           const hts_region reg,
+                           const count_params params,
+                           const AEVSettings settings,
+                           std::vector<int> &result,
+                           size_t n_shards,
+                           const aln_opts &opts = {}) {
+    if (result.size() != reg.rlen * N_FIELDS_PER_OBS) {
+        throw std::invalid_argument (
+            "count_sharded - result not sized for region");
+    }
+    auto shards = shard_region (reg, n_shards);
+
+    std::vector<std::exception_ptr> errors (shards.size());
+    std::vector<std::thread> workers;
+    workers.reserve (shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        size_t row = static_cast<size_t> (shards[i].start - reg.start);
+        int *slice = result.data() + row * N_FIELDS_PER_OBS;
+        workers.emplace_back ([&, i, slice] () {
+            try {
+                count_shard (aln_path, aln_idx, shards[i], params,
+                             settings, slice, opts);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto &w : workers)
+        w.join();
+
+    for (auto &e : errors) {
+        if (e)
+            std::rethrow_exception (e);
+    }
+}
+
+inline constexpr size_t SHARD_WINDOW_ROWS = 1 << 19;
+
+// count reg in successive blocks on up to n_shards threads, handing
+// the rows of each block passing filter to sink in order once it and
+// those before it are counted. Each thread keeps one file handle open
+// for the whole run and takes the next uncounted block, which is
+// fetched and counted as in count_sharded(). At most window_rows rows
+// are held whatever the region length or number of threads
+inline void count_sharded_streaming (const std::string &aln_path,
+                                     hts_idx_t *aln_idx,
+                                     const hts_region reg,
+                                     const count_params params,
+                                     const AEVSettings settings,
+                                     size_t n_shards,
+                                     const row_sink &sink,
+                                     const aln_opts &opts = {},
+                                     RowFilter filter = RowFilter::all,
+                                     size_t window_rows =
+                                         SHARD_WINDOW_ROWS) {
+    n_shards = std::max<size_t> (1, n_shards);
+    // two blocks per thread in flight, one being counted and one
+    // waiting its turn, but no smaller than needed to give each
+    // thread a block of a short region
+    size_t ahead = 2 * n_shards;
+    size_t block_rows = std::max<size_t> (
+        1, std::min (window_rows / ahead,
+                     (reg.rlen + n_shards - 1) / n_shards));
+    size_t n_blocks = (reg.rlen + block_rows - 1) / block_rows;
+
+    std::vector<AlnHandle> handles (
+        std::max<size_t> (1, std::min (n_shards, n_blocks)));
+    stream_ordered (
+        n_blocks, handles.size(), ahead,
+        [&] (size_t i, size_t worker, std::vector<int> &rows) {
+            size_t first_row = i * block_rows;
+            auto block = hts_region::by_len (
+                reg.rid, reg.start + static_cast<int64_t> (first_row),
+                std::min (block_rows, reg.rlen - first_row));
+            AlnHandle &h = handles[worker];
+            if (!h.is_open())
+                h.open (aln_path, aln_idx, settings, opts);
+            rows.assign (block.rlen * N_FIELDS_PER_OBS, 0);
+            AlleleEventCounter aev (params, rows.data(), settings);
+            count (h.file(), h.index(), aev, block, params);
+        },
+        [&] (size_t i, const std::vector<int> &rows) {
+            sink_filtered (filter, sink, i * block_rows, rows.data(),
+                           rows.size() / N_FIELDS_PER_OBS);
+        });
+}
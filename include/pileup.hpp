@@ -5,29 +5,134 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <cstdlib>
+#include <deque>
 #include <htslib/sam.h>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
 #include "bounds.hpp"
 #include "const.hpp"
 
+// the classify loop of _count_batch is written to vectorise, but GCC
+// only does so at -O3, its cost model at -O2 leaving it scalar. Ask
+// for it on that one function, so the build type stays the user's.
+// Clang vectorises it at -O2 as it is
+#if defined(__GNUC__) && !defined(__clang__)
+#define PEV_VECTORISE \
+    __attribute__ ((optimize ("tree-vectorize", "vect-cost-model=dynamic")))
+#else
+#define PEV_VECTORISE
+#endif
+
 // NOTE: there is definitely room for optimisation here.
 // I haven't profile yet, so it is unknown whether
 // doing so is necessary
 
+struct run_stats; // see stats.hpp
+
 struct count_params {
     int min_baseq, min_mapq, clip_bound, max_depth, include_flag,
         exclude_flag;
+    // where to gather statistics of the run, if anywhere
+    run_stats *stats = nullptr;
+    // downsampling (see downsample.hpp): a template is kept when the
+    // hash of its qname and seed is below keep_below, UINT64_MAX
+    // keeping all. A downsample_depth above 0 is resolved into
+    // keep_below per query, from the depth of the query's region
+    uint64_t keep_below = UINT64_MAX;
+    uint64_t downsample_seed = 0;
+    int downsample_depth = 0;
+};
+
+
+// per-read values that do not change along the read. Filled once
+// when the read enters the pileup (see pileup_construct in
+// count.hpp) and reached from every column via bam_pileup1_t::cd
+struct ReadMeta {
+    int32_t qlen;
+    uint8_t map_q;
+    bool rev;
+    // the other read of the template while both are in the pileup,
+    // only linked when pairing mates
+    ReadMeta *mate;
+    bool awaiting_mate;
+    // index of this read in the column last counted
+    size_t col_slot;
 };
 
+// recycles ReadMeta slots as reads leave the pileup, so only a pileup
+// deeper than any seen before allocates.
+//
+// With pair_mates, reads are linked to their mate by qname as they
+// enter, so each qname is hashed once per read rather than once per
+// column
+class ReadMetaCache {
+  private:
+    std::deque<ReadMeta> slots; // deque so handed out slots never move
+    std::vector<ReadMeta *> free_slots;
+    bool pair_mates;
+    // reads whose mate has not yet entered the pileup. Keys view the
+    // qname in the pileup's own copy of the record, which lives until
+    // the read is released
+    std::unordered_map<std::string_view, ReadMeta *> unpaired;
+
+  public:
+    explicit ReadMetaCache (bool pair_mates_ = false)
+        : pair_mates (pair_mates_) {}
+
+    ReadMeta *acquire (const bam1_t *b) {
+        ReadMeta *m;
+        if (free_slots.empty()) {
+            slots.emplace_back();
+            m = &slots.back();
+        } else {
+            m = free_slots.back();
+            free_slots.pop_back();
+        }
+        m->qlen = b->core.l_qseq;
+        m->map_q = b->core.qual;
+        m->rev = bam_is_rev (b);
+        m->mate = nullptr;
+        m->awaiting_mate = false;
+        m->col_slot = SIZE_MAX;
+
+        if (pair_mates) {
+            auto emp = unpaired.emplace (
+                std::string_view (bam_get_qname (b)), m);
+            if (emp.second) {
+                m->awaiting_mate = true;
+            } else {
+                ReadMeta *mate = emp.first->second;
+                unpaired.erase (emp.first);
+                mate->awaiting_mate = false;
+                mate->mate = m;
+                m->mate = mate;
+            }
+        }
+        return m;
+    }
+
+    void release (const bam1_t *b,
+                  ReadMeta *m) {
+        if (m->awaiting_mate)
+            unpaired.erase (std::string_view (bam_get_qname (b)));
+        if (m->mate)
+            m->mate->mate = nullptr;
+        free_slots.push_back (m);
+    }
+};
 
-// cleave tie to bam pointer
+// cleave tie to bam pointer. Built on the stack per (read, column)
+// from the cached ReadMeta, so holds no owned data
 struct PileupReadInfo {
     int32_t qpos;
-    std::string qname;
+    const char *qname; // points into the bam record, not copied
     int32_t qlen;
     uint8_t map_q;
     uint8_t base_nt16i; // 0-15
@@ -35,21 +140,23 @@ struct PileupReadInfo {
     int indel;
     bool rev, is_del, is_head, is_tail;
 
+    // p must come from a pileup with pileup_construct registered
     static PileupReadInfo from_pileup (const bam_pileup1_t &p) {
-        uint8_t nt = static_cast<uint8_t> (
-            safe_size (bam_seqi (bam_get_seq (p.b), p.qpos),
-                       {0, 15,
-                        "unexpected result when accessing base at "
-                        "pileup postion"}));
+        const ReadMeta &m = *static_cast<const ReadMeta *> (p.cd.p);
+        // a 4 bit code by construction, so only checked in debug
+        uint8_t nt = static_cast<uint8_t> (hot_bounds::size (
+            bam_seqi (bam_get_seq (p.b), p.qpos),
+            "unexpected result when accessing base at pileup postion",
+            15));
         // clang-format off
         return PileupReadInfo{p.qpos,
-                              std::string (bam_get_qname (p.b)),
-                              p.b->core.l_qseq,
-                              p.b->core.qual,
+                              bam_get_qname (p.b),
+                              m.qlen,
+                              m.map_q,
                               nt,
                               bam_get_qual (p.b)[p.qpos],
                               p.indel,
-                              bam_is_rev (p.b),
+                              m.rev,
                               p.is_del != 0,
                               p.is_head != 0,
                               p.is_tail != 0};
@@ -69,8 +176,11 @@ inline constexpr uint8_t FLAG_FINS =
 inline constexpr uint8_t FLAG_HEAD = (1 << 5); // Head
 inline constexpr uint8_t FLAG_TAIL = (1 << 6); // Tail
 inline constexpr uint8_t FLAG_IS_DEL = (1 << 7); // Is a deleted base
-inline uint8_t get_pileup_flag (const count_params &params,
-                                const PileupReadInfo &p) {
+// Clip is whether params.clip_bound can fail a position at all; with
+// a bound of zero or less no read position is below it
+template <bool Clip>
+inline uint8_t pileup_flag (const count_params &params,
+                            const PileupReadInfo &p) {
     /* LOOKUP TABLES */
     // Indexed as: map[is_del][is_head][is_tail]
     constexpr uint8_t EVENT_TO_FLAG[2][2][2] = {
@@ -103,9 +213,20 @@ inline uint8_t get_pileup_flag (const count_params &params,
         QUAL_FAIL_TO_FLAG[p.base_q <= params.min_baseq] |
         // Position fail (should the test be separate for forward and
         // reverse?)
-        POS_FAIL_TO_FLAG[(
-            p.qpos < params.clip_bound ||
-            (p.base_q && p.qlen - p.qpos < params.clip_bound))];
+        (Clip ? POS_FAIL_TO_FLAG[(
+                    p.qpos < params.clip_bound ||
+                    (p.base_q && p.qlen - p.qpos < params.clip_bound))]
+              : FLAG_UNSET);
+}
+
+inline bool clips (const count_params &params) {
+    return params.clip_bound > 0;
+}
+
+inline uint8_t get_pileup_flag (const count_params &params,
+                                const PileupReadInfo &p) {
+    return clips (params) ? pileup_flag<true> (params, p)
+                          : pileup_flag<false> (params, p);
 }
 
 struct BaseInfo {
@@ -133,11 +254,12 @@ struct BasePairInfo {
     BaseInfo baseinfo[2];
 };
 
+template <bool Clip = true>
 inline void base_set (BaseInfo &b,
                       const count_params &params,
                       const PileupReadInfo &pri) {
     b.base = pri.base_nt16i;
-    b.flag = get_pileup_flag (params, pri);
+    b.flag = pileup_flag<Clip> (params, pri);
     b.map_quality = pri.map_q;
 }
 
@@ -146,50 +268,49 @@ struct AEVSettings {
     bool discard_overlaps = false;
 };
 
+// the reads of one column as contiguous arrays, one entry per read,
+// so classifying and tallying them is a plain loop over bytes that
+// the compiler vectorises. Reused between columns
+struct ColumnBatch {
+    std::vector<uint8_t> base, base_q, map_q, rev, is_del, head, tail,
+        fdel, fins, pos_fail;
+    // derived: strand offset plus allele field
+    std::vector<uint8_t> key;
+
+    void resize (size_t n) {
+        if (n <= key.size())
+            return;
+        for (auto *v : {&base, &base_q, &map_q, &rev, &is_del, &head,
+                        &tail, &fdel, &fins, &pos_fail, &key})
+            v->resize (n);
+    }
+};
+
 class AlleleEventCounter {
   private:
     const count_params params;
-    std::vector<int> &counts;
+    int *counts; // first cell of the block for position offset 0
     AEVSettings settings;
+    ColumnBatch batch;
 
   public:
     AlleleEventCounter (const count_params params_,
                         std::vector<int> &counts_,
                         AEVSettings settings_)
+        : params (params_),
+          counts (counts_.data()),
+          settings (settings_) {}
+
+    // count into a slice of a larger result, e.g. one shard of a
+    // region. Caller guarantees the slice outlives the counter
+    AlleleEventCounter (const count_params params_,
+                        int *counts_,
+                        AEVSettings settings_)
         : params (params_),
           counts (counts_),
           settings (settings_) {}
 
-    void _collate_alleles (const count_params &par,
-                           const PileupReadInfo &pir,
-                           std::unordered_map<std::string,
-                                              BasePairInfo> &m) {
-        // first seen goes into [0], second into [1]
-        // n.b. BaseInfoPair ctor inits .base to UNDEFINED_VALUE
-        auto emp = m.emplace (
-            pir.qname, BasePairInfo{}); // could be more efficient
-        auto kv = emp.first;
-        // if there was already a key, emplace fails and nothing
-        // inserted.
-        bool qname_new_to_map = emp.second;
-        BasePairInfo &bp = kv->second;
-
-        auto b0 = bp.baseinfo[0].base;
-        auto b1 = bp.baseinfo[1].base;
-
-        int to_set;
-        if (!qname_new_to_map) { // qname seen before
-            if (b0 == UNDEFINED_VALUE || b1 != UNDEFINED_VALUE) {
-                throw std::runtime_error ("pair map malformed! " +
-                                          pir.qname);
-            }
-            to_set = 1;
-        } else {
-            to_set = 0;
-        }
-        // fill new
-        base_set (bp.baseinfo[to_set], par, pir);
-    }
+    const AEVSettings &get_settings () const { return settings; }
 
     void _score_single (const BaseInfo b,
                         const size_t pos_offset) {
@@ -284,32 +405,210 @@ class AlleleEventCounter {
         pair_toggle = !pair_toggle;
     }
 
-    void count_pileup (const bam_pileup1_t *pileups_ptr,
+    // count each read of a column in turn through _score_single
+    void _count_reads (const bam_pileup1_t *pileups_ptr,
                        const size_t pos_block_offset,
                        const size_t n_reads) {
-        if (!settings.discard_overlaps) {
-            for (size_t i = 0; i < n_reads; ++i) {
-                const bam_pileup1_t htspile = *(pileups_ptr + i);
-                BaseInfo b;
-                // TODO: wasteful intermediate conversion
-                b.from_pinfo (PileupReadInfo::from_pileup (htspile),
-                              params);
-                _score_single (b, pos_block_offset);
+        for (size_t i = 0; i < n_reads; ++i) {
+            BaseInfo b;
+            b.from_pinfo (PileupReadInfo::from_pileup (pileups_ptr[i]),
+                          params);
+            _score_single (b, pos_block_offset);
+        }
+    }
+
+    // _count_reads, batched: the reads' values are gathered into
+    // byte arrays, then one branch-free (vectorised) pass classifies
+    // each read to its allele field and sums the per-strand fields,
+    // and a last pass histograms the allele fields. Gives the same
+    // counts as get_pileup_flag and _score_single
+    template <bool Clip>
+    PEV_VECTORISE void _count_batch (const bam_pileup1_t *pileups_ptr,
+                                     const size_t pos_block_offset,
+                                     const size_t n) {
+        ColumnBatch &cb = batch;
+        cb.resize (n);
+
+        // gather, the only step touching the reads themselves. The
+        // position test needs the wider qpos and qlen, so is made
+        // here rather than widening the pass below
+        const int clip = params.clip_bound;
+        for (size_t i = 0; i < n; ++i) {
+            PileupReadInfo pr =
+                PileupReadInfo::from_pileup (pileups_ptr[i]);
+            cb.base[i] = pr.base_nt16i;
+            cb.base_q[i] = pr.base_q;
+            cb.map_q[i] = pr.map_q;
+            cb.rev[i] = pr.rev;
+            cb.is_del[i] = pr.is_del;
+            cb.head[i] = pr.is_head;
+            cb.tail[i] = pr.is_tail;
+            cb.fdel[i] = pr.indel < 0;
+            cb.fins[i] = pr.indel > 0;
+            cb.pos_fail[i] = Clip &&
+                ((pr.qpos < clip) |
+                 ((pr.base_q != 0) & (pr.qlen - pr.qpos < clip)));
+        }
+
+        // classify and sum. A read failing the position test counts
+        // as N with no mapq; otherwise a deletion as IS_DEL, and a
+        // base as N if failing the quality test. Only bases count
+        // FDEL and FINS. Every operand is loaded unconditionally and
+        // each choice is a select, so the loop has no control flow
+        const uint8_t *__restrict base = cb.base.data();
+        const uint8_t *__restrict base_q = cb.base_q.data();
+        const uint8_t *__restrict map_q = cb.map_q.data();
+        const uint8_t *__restrict rev = cb.rev.data();
+        const uint8_t *__restrict is_del = cb.is_del.data();
+        const uint8_t *__restrict head = cb.head.data();
+        const uint8_t *__restrict tail = cb.tail.data();
+        const uint8_t *__restrict fdel = cb.fdel.data();
+        const uint8_t *__restrict fins = cb.fins.data();
+        const uint8_t *__restrict pos_fail = cb.pos_fail.data();
+        uint8_t *__restrict key = cb.key.data();
+        // base_q <= min_baseq, on bytes
+        const uint8_t check_q = params.min_baseq >= 0;
+        const uint8_t min_q =
+            static_cast<uint8_t> (std::clamp (params.min_baseq, 0, 255));
+        // x where c is 1, else y, as a mask rather than a branch
+        auto pick = [] (uint8_t c, uint8_t x, uint8_t y) {
+            return static_cast<uint8_t> (
+                y ^ ((x ^ y) & static_cast<uint8_t> (-c)));
+        };
+        int head_f = 0, head_r = 0, tail_f = 0, tail_r = 0;
+        int fdel_f = 0, fdel_r = 0, fins_f = 0, fins_r = 0;
+        int map_q_f = 0, map_q_r = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t b = base[i];
+            uint8_t pf = pos_fail[i];
+            uint8_t del = is_del[i];
+            uint8_t r = rev[i];
+            uint8_t fwd = r ^ 1;
+            uint8_t qual_fail = check_q & (base_q[i] <= min_q);
+            uint8_t field = FIELD_N;
+            field = pick (b == HTS_NT_A, FIELD_A, field);
+            field = pick (b == HTS_NT_T, FIELD_T, field);
+            field = pick (b == HTS_NT_C, FIELD_C, field);
+            field = pick (b == HTS_NT_G, FIELD_G, field);
+            field = pick (qual_fail, FIELD_N, field);
+            field = pick (del, FIELD_IS_DEL, field);
+            field = pick (pf, FIELD_N, field);
+            key[i] = static_cast<uint8_t> (
+                field + (r & 1) * RSTRAND_OFFSET);
+
+            uint8_t is_base = (pf | del) ^ 1;
+            uint8_t mq = pick (pf, 0, map_q[i]);
+            head_f += head[i] & fwd;
+            head_r += head[i] & r;
+            tail_f += tail[i] & fwd;
+            tail_r += tail[i] & r;
+            fdel_f += fdel[i] & is_base & fwd;
+            fdel_r += fdel[i] & is_base & r;
+            fins_f += fins[i] & is_base & fwd;
+            fins_r += fins[i] & is_base & r;
+            map_q_f += mq & static_cast<uint8_t> (-fwd);
+            map_q_r += mq & static_cast<uint8_t> (-r);
+        }
+        const int head_n[2] = {head_f, head_r};
+        const int tail_n[2] = {tail_f, tail_r};
+        const int fdel_n[2] = {fdel_f, fdel_r};
+        const int fins_n[2] = {fins_f, fins_r};
+        const int map_q_n[2] = {map_q_f, map_q_r};
+
+        // each read adds to one allele field of its strand, so the
+        // allele fields also give the reads per strand
+        int hist[N_FIELDS_PER_OBS] = {};
+        for (size_t i = 0; i < n; ++i)
+            ++hist[key[i]];
+        int *row = counts + pos_block_offset * N_FIELDS_PER_OBS;
+        constexpr uint8_t alleles[] = {FIELD_A, FIELD_T, FIELD_C,
+                                       FIELD_G, FIELD_IS_DEL, FIELD_N};
+        for (size_t s = 0; s < 2; ++s) {
+            size_t off = s * RSTRAND_OFFSET;
+            int n_obs = 0;
+            for (uint8_t f : alleles) {
+                row[off + f] += hist[off + f];
+                n_obs += hist[off + f];
             }
+            row[off + FIELD_NOBS] += n_obs;
+            row[off + FIELD_HEAD] += head_n[s];
+            row[off + FIELD_TAIL] += tail_n[s];
+            row[off + FIELD_FDEL] += fdel_n[s];
+            row[off + FIELD_FINS] += fins_n[s];
+            row[off + FIELD_MAPQ] += map_q_n[s];
+        }
+    }
+
+    // count_pileup for a known set of features, so the branches on
+    // them are resolved at compile time. Overlaps must match
+    // settings.discard_overlaps and Clip clips (params)
+    template <bool Overlaps, bool Clip>
+    void count_pileup_as (const bam_pileup1_t *pileups_ptr,
+                          const size_t pos_block_offset,
+                          const size_t n_reads) {
+        if constexpr (!Overlaps) {
+            _count_batch<Clip> (pileups_ptr, pos_block_offset, n_reads);
         } else {
-            // Collate alleles by read pair
-            std::unordered_map<std::string, BasePairInfo> qname_map;
+            // note where each read sits in this column, so a read can
+            // tell whether its mate is here too
             for (size_t i = 0; i < n_reads; ++i) {
-                const bam_pileup1_t htspile = *(pileups_ptr + i);
-                auto pinfo = PileupReadInfo::from_pileup (htspile);
-                _collate_alleles (params, pinfo, qname_map);
+                static_cast<ReadMeta *> (pileups_ptr[i].cd.p)
+                    ->col_slot = i;
             }
 
-            // Count
+            // pairs are scored once, at the first seen read of the
+            // two, with that read in baseinfo[0]
             int toggle = 0;
-            for (auto &[qname, bpair] : qname_map) {
+            for (size_t i = 0; i < n_reads; ++i) {
+                const bam_pileup1_t &htspile = *(pileups_ptr + i);
+                const ReadMeta *mate =
+                    static_cast<const ReadMeta *> (htspile.cd.p)->mate;
+                size_t j = mate ? mate->col_slot : SIZE_MAX;
+                // a stale slot from an earlier column will not point
+                // back to the mate
+                bool mate_here =
+                    j < n_reads && pileups_ptr[j].cd.p == mate;
+                if (mate_here && j < i)
+                    continue; // already scored with its mate
+
+                BasePairInfo bpair;
+                base_set<Clip> (bpair.baseinfo[0], params,
+                                PileupReadInfo::from_pileup (htspile));
+                if (mate_here) {
+                    base_set<Clip> (bpair.baseinfo[1], params,
+                                    PileupReadInfo::from_pileup (
+                                        pileups_ptr[j]));
+                }
                 _score_pair (bpair, pos_block_offset, toggle);
             }
         }
     }
+
+    void count_pileup (const bam_pileup1_t *pileups_ptr,
+                       const size_t pos_block_offset,
+                       const size_t n_reads) {
+        with_variant ([&] (auto overlaps, auto clip) {
+            count_pileup_as<decltype (overlaps)::value,
+                            decltype (clip)::value> (
+                pileups_ptr, pos_block_offset, n_reads);
+        });
+    }
+
+    // call fn (overlaps, clip) with this counter's features as
+    // std::bool_constant, so callers can pick the matching
+    // count_pileup_as once for a whole run
+    template <typename F>
+    void with_variant (F &&fn) const {
+        if (settings.discard_overlaps) {
+            if (clips (params))
+                fn (std::true_type{}, std::true_type{});
+            else
+                fn (std::true_type{}, std::false_type{});
+        } else {
+            if (clips (params))
+                fn (std::false_type{}, std::true_type{});
+            else
+                fn (std::false_type{}, std::false_type{});
+        }
+    }
 };
@@ -0,0 +1,157 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include "const.hpp"
+#include "count.hpp"
+#include "structs.hpp"
+
+// regions merged into one index query and pileup over span. members
+// index the planned regions, ordered by start
+struct region_plan {
+    hts_region span;
+    std::vector<size_t> members;
+};
+
+// what planning saved against querying each region on its own
+struct plan_stats {
+    size_t regions = 0;
+    size_t queries = 0; // index seeks issued
+    uint64_t reads_fetched = 0; // reads decoded by the queries issued
+    uint64_t reads_unplanned = 0; // by one query per region instead
+
+    size_t seeks_saved () const { return regions - queries; }
+    int64_t reads_saved () const {
+        return static_cast<int64_t> (reads_unplanned) -
+            static_cast<int64_t> (reads_fetched);
+    }
+};
+
+// sort regions and merge those on the same contig that overlap or lie
+// within max_gap of each other. A negative max_gap merges nothing
+inline std::vector<region_plan>
+plan_regions (const std::vector<hts_region> &regions,
+              int64_t max_gap) {
+    std::vector<size_t> order (regions.size());
+    std::iota (order.begin(), order.end(), 0);
+    std::stable_sort (order.begin(), order.end(),
+                      [&] (size_t a, size_t b) {
+        const hts_region &ra = regions[a], &rb = regions[b];
+        return ra.rid != rb.rid ? ra.rid < rb.rid : ra.start < rb.start;
+    });
+
+    std::vector<region_plan> plans;
+    for (size_t i : order) {
+        const hts_region &r = regions[i];
+        if (!plans.empty() && max_gap >= 0) {
+            region_plan &cur = plans.back();
+            if (cur.span.rid == r.rid &&
+                r.start - cur.span.end <= max_gap) {
+                cur.span = hts_region::by_end (
+                    r.rid, cur.span.start, std::max (cur.span.end, r.end));
+                cur.members.push_back (i);
+                continue;
+            }
+        }
+        plans.push_back (region_plan{r, {i}});
+    }
+    return plans;
+}
+
+// rows of region (an index into the planned regions) starting
+// first_row positions after its start
+using planned_sink = std::function<void (size_t region,
+                                         size_t first_row,
+                                         const int *rows,
+                                         size_t n_rows)>;
+
+// tallies the reads each plan decodes, and how many of its member
+// queries each read would have been decoded by on their own
+struct plan_fetch_tally {
+    const std::vector<hts_region> *regions;
+    const region_plan *plan;
+    plan_stats *stats;
+};
+
+extern "C" {
+inline void plan_count_fetch (void *ctx,
+                              const bam1_t *b) {
+    auto *t = static_cast<plan_fetch_tally *> (ctx);
+    int64_t beg = b->core.pos;
+    int64_t end = std::max<int64_t> (bam_endpos (b), beg + 1);
+    ++t->stats->reads_fetched;
+    for (size_t m : t->plan->members) {
+        const hts_region &r = (*t->regions)[m];
+        if (r.start >= end)
+            break; // members are ordered by start
+        if (r.end > beg)
+            ++t->stats->reads_unplanned;
+    }
+}
+}
+
+// count each planned region through a single streamed pileup over its
+// plan's span, scattering each block of rows back to the members it
+// covers. Counts equal those of separate queries, as a column holds
+// the same reads in the same order whichever query fetched them,
+// excepting (as for sharding) columns truncated by max_depth. Rows
+// of a region are handed over in order, but those of regions sharing
+// a plan arrive interleaved where the regions overlap
+inline void count_planned (htsFile *aln_fh,
+                           hts_idx_t *aln_idx,
+                           const std::vector<hts_region> &regions,
+                           const std::vector<region_plan> &plans,
+                           const count_params params,
+                           const AEVSettings settings,
+                           const planned_sink &sink,
+                           RowFilter filter = RowFilter::all,
+                           plan_stats *stats = nullptr) {
+    // a plan's depth is not its members'
+    if (params.downsample_depth > 0) {
+        throw std::invalid_argument (
+            "count_planned - downsample_depth would be resolved per "
+            "plan, not per region");
+    }
+    plan_stats local;
+    plan_stats &st = stats ? *stats : local;
+    for (const region_plan &plan : plans) {
+        st.regions += plan.members.size();
+        ++st.queries;
+        plan_fetch_tally tally{&regions, &plan, &st};
+
+        auto scatter = [&] (size_t first_row, const int *rows,
+                            size_t n_rows) {
+            int64_t lo = plan.span.start +
+                static_cast<int64_t> (first_row);
+            int64_t hi = lo + static_cast<int64_t> (n_rows);
+            for (size_t m : plan.members) {
+                const hts_region &r = regions[m];
+                if (r.start >= hi)
+                    break;
+                int64_t b = std::max (lo, r.start);
+                int64_t e = std::min (hi, r.end);
+                if (b >= e)
+                    continue;
+                sink (m, static_cast<size_t> (b - r.start),
+                      rows + static_cast<size_t> (b - lo) *
+                          N_FIELDS_PER_OBS,
+                      static_cast<size_t> (e - b));
+            }
+        };
+        count_streaming (aln_fh, aln_idx, plan.span, params, settings,
+                         scatter, filter, STREAM_WINDOW_ROWS,
+                         fetch_hook{plan_count_fetch, &tally});
+    }
+}
@@ -0,0 +1,130 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <cstdint>
+#include <htslib/sam.h>
+
+// regions at most this long are counted by walking each read's CIGAR
+// to each position rather than by a pileup (see count_point)
+inline constexpr size_t POINT_QUERY_MAX_LEN = 16;
+
+inline bool cigar_consumes_ref (int op) {
+    return op == BAM_CMATCH || op == BAM_CDEL || op == BAM_CREF_SKIP ||
+        op == BAM_CEQUAL || op == BAM_CDIFF;
+}
+
+inline bool cigar_is_match (int op) {
+    return op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF;
+}
+
+// whether b's CIGAR can be walked directly with the same result as
+// the pileup. htslib steps through operations one per position, so
+// zero length ones can make it differ, as can a read that consumes no
+// reference at all
+inline bool cigar_walkable (const bam1_t *b) {
+    const uint32_t *cigar = bam_get_cigar (b);
+    bool on_ref = false;
+    for (uint32_t k = 0; k < b->core.n_cigar; ++k) {
+        if (bam_cigar_oplen (cigar[k]) == 0)
+            return false;
+        on_ref = on_ref || cigar_consumes_ref (bam_cigar_op (cigar[k]));
+    }
+    return on_ref;
+}
+
+// fill p as htslib's pileup (resolve_cigar2) would for read b at
+// reference position pos, walking the CIGAR directly. Returns false
+// when b does not cover pos. Only qpos, indel, is_del, is_head,
+// is_tail, is_refskip and cigar_ind are set
+inline bool resolve_at (const bam1_t *b,
+                        int64_t pos,
+                        bam_pileup1_t &p) {
+    const uint32_t *cigar = bam_get_cigar (b);
+    const uint32_t n_cigar = b->core.n_cigar;
+    int64_t x = b->core.pos; // reference position of op k
+    int32_t y = 0; // query position of op k
+    uint32_t k = 0;
+    for (; k < n_cigar; ++k) {
+        int op = bam_cigar_op (cigar[k]);
+        int64_t l = bam_cigar_oplen (cigar[k]);
+        if (cigar_consumes_ref (op)) {
+            if (pos < x + l)
+                break;
+            x += l;
+            if (cigar_is_match (op))
+                y += static_cast<int32_t> (l);
+        } else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) {
+            y += static_cast<int32_t> (l);
+        }
+    }
+    if (k == n_cigar || pos < b->core.pos)
+        return false;
+
+    int op = bam_cigar_op (cigar[k]);
+    int64_t l = bam_cigar_oplen (cigar[k]);
+    p.is_del = p.is_refskip = 0;
+    p.indel = 0;
+    // on the last base of the operation, peek at what follows,
+    // merging runs as htslib does
+    if (x + l - 1 == pos && k + 1 < n_cigar) {
+        int op2 = bam_cigar_op (cigar[k + 1]);
+        int l2 = static_cast<int> (bam_cigar_oplen (cigar[k + 1]));
+        if (op2 == BAM_CDEL && op != BAM_CDEL) {
+            // 1D2D as 3D; within the run indel stays 0
+            p.indel = -l2;
+            for (uint32_t j = k + 2; j < n_cigar; ++j) {
+                if (bam_cigar_op (cigar[j]) != BAM_CDEL)
+                    break;
+                l2 = static_cast<int> (bam_cigar_oplen (cigar[j]));
+                p.indel -= l2;
+            }
+        } else if (op2 == BAM_CINS) {
+            // 1I2I and 1I2P3I as 3I
+            p.indel = l2;
+            for (uint32_t j = k + 2; j < n_cigar; ++j) {
+                op2 = bam_cigar_op (cigar[j]);
+                l2 = static_cast<int> (bam_cigar_oplen (cigar[j]));
+                if (op2 == BAM_CINS)
+                    p.indel += l2;
+                else if (op2 != BAM_CPAD)
+                    break;
+            }
+        } else if (op2 == BAM_CPAD && k + 2 < n_cigar) {
+            // up to the next D/M/=/X: htslib carries on past N
+            int l3 = 0;
+            for (uint32_t j = k + 2; j < n_cigar; ++j) {
+                op2 = bam_cigar_op (cigar[j]);
+                l2 = static_cast<int> (bam_cigar_oplen (cigar[j]));
+                if (op2 == BAM_CINS)
+                    l3 += l2;
+                else if (op2 == BAM_CDEL || cigar_is_match (op2))
+                    break;
+            }
+            if (l3 > 0)
+                p.indel = l3;
+        }
+    }
+    if (cigar_is_match (op)) {
+        p.qpos = y + static_cast<int32_t> (pos - x);
+    } else {
+        // deletions and reference skips alike, as in htslib
+        p.is_del = 1;
+        p.qpos = y;
+        p.is_refskip = op == BAM_CREF_SKIP;
+    }
+
+    // the reference span of the read, as the pileup computes it
+    int64_t end = b->core.pos;
+    for (uint32_t j = 0; j < n_cigar; ++j) {
+        if (cigar_consumes_ref (bam_cigar_op (cigar[j])))
+            end += bam_cigar_oplen (cigar[j]);
+    }
+    p.is_head = pos == b->core.pos;
+    p.is_tail = pos == end - 1;
+    p.cigar_ind = static_cast<int> (k);
+    return true;
+}
@@ -0,0 +1,135 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <htslib/sam.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "structs.hpp"
+
+// a region plus the label its rows are tagged with on output
+struct named_region {
+    std::string name;
+    hts_region reg;
+};
+
+// parse a samtools style region string against the header.
+// open ended regions (chr1:100-) are clamped to the contig length
+inline hts_region parse_region (sam_hdr_t *head,
+                                const std::string &region_str) {
+    int tid = -3;
+    int64_t start, end;
+    auto rp = sam_parse_region (head, region_str.c_str(), &tid, &start,
+                                &end, HTS_PARSE_ONE_COORD);
+    if (rp == NULL) {
+        std::string msg;
+        switch (tid) {
+            case -2:
+                msg = "memory error";
+                break;
+            case -1:
+                msg = "could not parse contig";
+                break;
+            default:
+                msg = "specified range could not be parsed";
+        }
+        throw std::runtime_error ("parse failed for input region " +
+                                  region_str + " - " + msg);
+    }
+    int64_t tlen = sam_hdr_tid2len (head, tid);
+    if (tlen > 0)
+        end = std::min (end, tlen);
+    // converts to 0-indexed internal postions from 1-indexed
+    // region str
+    return hts_region::by_end (tid, start, end);
+}
+
+// a line of a regions file is either BED (tab separated, 0-based,
+// end-exclusive) or a region string as accepted on the command line
+inline named_region parse_region_line (sam_hdr_t *head,
+                                       const std::string &line) {
+    if (line.find ('\t') == std::string::npos) {
+        return named_region{line, parse_region (head, line)};
+    }
+
+    std::istringstream fields (line);
+    std::string contig, start_str, end_str;
+    if (!std::getline (fields, contig, '\t') ||
+        !std::getline (fields, start_str, '\t') ||
+        !std::getline (fields, end_str, '\t')) {
+        throw std::runtime_error ("BED line has fewer than 3 fields: " +
+                                  line);
+    }
+    int tid = sam_hdr_name2tid (head, contig.c_str());
+    if (tid < 0) {
+        throw std::runtime_error ("could not find contig " + contig +
+                                  " in alignment header");
+    }
+    int64_t start, end;
+    try {
+        start = std::stoll (start_str);
+        end = std::stoll (end_str);
+    } catch (std::exception &) {
+        throw std::runtime_error ("could not parse BED coordinates: " +
+                                  line);
+    }
+    // tag with the equivalent 1-based region string
+    return named_region{contig + ":" + std::to_string (start + 1) +
+                            "-" + std::to_string (end),
+                        hts_region::by_end (tid, start, end)};
+}
+
+// the region lines of a regions file, skipping blanks, comments and
+// BED track/browser lines. Paired with their line numbers
+inline std::vector<std::pair<size_t, std::string>>
+read_region_lines (const std::string &path) {
+    std::ifstream in (path);
+    if (!in) {
+        throw std::runtime_error ("failed to open regions file " +
+                                  path);
+    }
+    std::vector<std::pair<size_t, std::string>> lines;
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline (in, line)) {
+        ++line_no;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#' ||
+            line.rfind ("track", 0) == 0 ||
+            line.rfind ("browser", 0) == 0)
+            continue;
+        lines.emplace_back (line_no, line);
+    }
+    if (lines.empty()) {
+        throw std::runtime_error ("no regions found in " + path);
+    }
+    return lines;
+}
+
+// read one region per line of a regions file
+inline std::vector<named_region>
+read_regions_file (sam_hdr_t *head,
+                   const std::string &path) {
+    std::vector<named_region> regions;
+    for (const auto &[line_no, line] : read_region_lines (path)) {
+        try {
+            regions.push_back (parse_region_line (head, line));
+        } catch (std::exception &e) {
+            throw std::runtime_error (path + " line " +
+                                      std::to_string (line_no) + ": " +
+                                      e.what());
+        }
+    }
+    return regions;
+}
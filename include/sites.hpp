@@ -0,0 +1,288 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+#include <htslib/sam.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "const.hpp"
+#include "count.hpp"
+#include "structs.hpp"
+
+// positions [start, end) to count at, 0-based. A VCF record is a
+// single position
+struct site {
+    int32_t rid;
+    int64_t start;
+    int64_t end;
+};
+
+// sites of a VCF (the POS of each record) or BED file (each interval,
+// overlapping intervals merged so a position comes once), plain text
+// or compressed. Records must be sorted: each contig in one block,
+// ascending starts within it
+inline std::vector<site> read_sites_file (sam_hdr_t *head,
+                                          const std::string &path) {
+    htsFile *fp = hts_open (path.c_str(), "r");
+    if (fp == NULL) {
+        throw std::runtime_error ("failed to open sites file " + path);
+    }
+    bool is_vcf = hts_get_format (fp)->format == vcf;
+    if (hts_get_format (fp)->format == bcf) {
+        hts_close (fp);
+        throw std::runtime_error ("BCF sites files are not supported, "
+                                  "convert to VCF: " + path);
+    }
+
+    std::vector<site> sites;
+    std::vector<bool> contig_done (
+        static_cast<size_t> (std::max (0, sam_hdr_nref (head))));
+    kstring_t line = KS_INITIALIZE;
+    size_t line_no = 0;
+    int64_t prev_start = -1;
+    try {
+        while (hts_getline (fp, KS_SEP_LINE, &line) >= 0) {
+            ++line_no;
+            std::string_view l (line.s, line.l);
+            if (!l.empty() && l.back() == '\r')
+                l.remove_suffix (1);
+            if (l.empty() || l[0] == '#' || l.rfind ("track", 0) == 0 ||
+                l.rfind ("browser", 0) == 0)
+                continue;
+
+            auto field = [&l] (size_t i) {
+                size_t b = 0;
+                for (; i > 0; --i) {
+                    b = l.find ('\t', b);
+                    if (b == std::string_view::npos)
+                        throw std::runtime_error ("too few fields");
+                    ++b;
+                }
+                size_t e = l.find ('\t', b);
+                return std::string (l.substr (b, e - b));
+            };
+            auto number = [] (const std::string &s) {
+                char *end = nullptr;
+                long long v = std::strtoll (s.c_str(), &end, 10);
+                if (s.empty() || *end != '\0')
+                    throw std::runtime_error ("bad coordinate " + s);
+                return static_cast<int64_t> (v);
+            };
+
+            std::string contig = field (0);
+            int tid = sam_hdr_name2tid (head, contig.c_str());
+            if (tid < 0) {
+                throw std::runtime_error ("could not find contig " +
+                                          contig +
+                                          " in alignment header");
+            }
+            // VCF POS is 1-based, BED 0-based and end-exclusive
+            int64_t start, end;
+            if (is_vcf) {
+                start = number (field (1)) - 1;
+                end = start + 1;
+            } else {
+                start = number (field (1));
+                end = number (field (2));
+            }
+            if (start < 0 || end <= start)
+                throw std::runtime_error ("empty or negative interval");
+
+            if (!sites.empty() && sites.back().rid != tid) {
+                contig_done[static_cast<size_t> (sites.back().rid)] =
+                    true;
+            }
+            bool same_contig = !sites.empty() && sites.back().rid == tid;
+            if (contig_done[static_cast<size_t> (tid)] ||
+                (same_contig && start < prev_start)) {
+                throw std::runtime_error ("sites are not sorted");
+            }
+            prev_start = start;
+            // overlapping intervals give each position once
+            if (!is_vcf && same_contig && start <= sites.back().end) {
+                sites.back().end = std::max (sites.back().end, end);
+                continue;
+            }
+            sites.push_back (site{tid, start, end});
+        }
+    } catch (std::exception &e) {
+        ks_free (&line);
+        hts_close (fp);
+        throw std::runtime_error (path + " line " +
+                                  std::to_string (line_no) + ": " +
+                                  e.what());
+    }
+    ks_free (&line);
+    if (hts_close (fp) != 0) {
+        throw std::runtime_error ("failed to read sites file " + path);
+    }
+    if (sites.empty()) {
+        throw std::runtime_error ("no sites found in " + path);
+    }
+    return sites;
+}
+
+// sites [first, last) of one contig counted by a single pileup over
+// reg, which spans them
+struct site_cluster {
+    size_t first;
+    size_t last;
+    hts_region reg;
+};
+
+// sites further apart than this start a new pileup, as a fresh index
+// query is cheaper than piling up every read in between
+inline constexpr int64_t SITE_CLUSTER_GAP = 1000;
+
+// group sorted sites into runs on one contig with no gap between
+// neighbours above max_gap. max_gap < 0 sweeps each contig whole
+inline std::vector<site_cluster>
+cluster_sites (const std::vector<site> &sites,
+               int64_t max_gap = SITE_CLUSTER_GAP) {
+    std::vector<site_cluster> clusters;
+    size_t first = 0;
+    int64_t end = sites.empty() ? 0 : sites[0].end;
+    for (size_t i = 1; i <= sites.size(); ++i) {
+        if (i < sites.size() && sites[i].rid == sites[first].rid &&
+            (max_gap < 0 || sites[i].start - (end - 1) <= max_gap)) {
+            end = std::max (end, sites[i].end);
+            continue;
+        }
+        clusters.push_back (site_cluster{
+            first, i,
+            hts_region::by_end (sites[first].rid, sites[first].start,
+                                end)});
+        first = i;
+        if (i < sites.size())
+            end = sites[i].end;
+    }
+    return clusters;
+}
+
+// count only at the positions of sorted sites, a row per position of
+// each site in ascending order (a position in several sites repeats
+// its row for each). Rows passing filter are gathered into blocks of
+// block_rows and handed to sink. Each cluster is a single index query
+// and pileup, so reads shared between nearby sites are decoded once
+// and only columns at a site are counted
+inline void count_sites (htsFile *aln_fh,
+                         hts_idx_t *aln_idx,
+                         const std::vector<site> &sites,
+                         const count_params params,
+                         const AEVSettings settings,
+                         const located_sink &sink,
+                         RowFilter filter = RowFilter::all,
+                         int64_t max_gap = SITE_CLUSTER_GAP,
+                         size_t block_rows = STREAM_WINDOW_ROWS) {
+    // a cluster's depth is not its sites'
+    if (params.downsample_depth > 0) {
+        throw std::invalid_argument (
+            "count_sites - downsample_depth would be resolved per "
+            "cluster, not per site");
+    }
+    block_rows = std::max<size_t> (1, block_rows);
+    std::vector<int> block (block_rows * N_FIELDS_PER_OBS, 0);
+    std::vector<int32_t> tids (block_rows);
+    std::vector<int64_t> pos (block_rows);
+    AlleleEventCounter ctr (params, block, settings);
+    size_t n = 0;
+    auto flush = [&] () {
+        sink (tids.data(), pos.data(), block.data(), n);
+        std::fill_n (block.begin(), n * N_FIELDS_PER_OBS, 0);
+        n = 0;
+    };
+    // hand over the row in block slot n, counted or left zero, once
+    // for each of the copies sites containing p
+    auto emit = [&] (int32_t rid, int64_t p, size_t copies) {
+        int *row = block.data() + n * N_FIELDS_PER_OBS;
+        if (!row_kept (filter, row)) {
+            std::fill_n (row, N_FIELDS_PER_OBS, 0);
+            return;
+        }
+        // the first copy is the row as counted, in place; saved
+        // outlives it being flushed for the copies after
+        std::array<int, N_FIELDS_PER_OBS> saved;
+        if (copies > 1)
+            std::copy_n (row, N_FIELDS_PER_OBS, saved.begin());
+        auto place = [&] () {
+            tids[n] = rid;
+            pos[n] = p;
+            if (++n == block_rows)
+                flush();
+        };
+        place();
+        for (size_t c = 1; c < copies; ++c) {
+            std::copy_n (saved.begin(), N_FIELDS_PER_OBS,
+                         block.data() + n * N_FIELDS_PER_OBS);
+            place();
+        }
+    };
+
+    std::vector<int64_t> open;
+    for (const site_cluster &c : cluster_sites (sites, max_gap)) {
+        // p walks the cluster's positions; open holds the ends of the
+        // sites containing it and k is the next site to open
+        size_t k = c.first;
+        int64_t p = c.reg.start;
+        open.clear();
+        auto cover = [&] () {
+            while (k < c.last && sites[k].start <= p)
+                open.push_back (sites[k++].end);
+            open.erase (std::remove_if (open.begin(), open.end(),
+                                        [&] (int64_t e) {
+                                            return e <= p;
+                                        }),
+                        open.end());
+            return open.size();
+        };
+        // site positions before up_to no read covers, so their rows
+        // are zero and only kept unfiltered
+        auto skip_to = [&] (int64_t up_to) {
+            while (p < up_to) {
+                if (filter != RowFilter::all) {
+                    p = up_to;
+                    return;
+                }
+                size_t copies = cover();
+                if (copies == 0) {
+                    if (k == c.last)
+                        return;
+                    p = std::min (up_to, sites[k].start);
+                    continue;
+                }
+                emit (c.reg.rid, p++, copies);
+            }
+        };
+
+        pileup_region (
+            aln_fh, aln_idx, c.reg, params, settings.discard_overlaps,
+            [&] (const bam_pileup1_t *pl, size_t pos_offset,
+                 size_t n_plp) {
+                int64_t at = c.reg.start +
+                    static_cast<int64_t> (pos_offset);
+                skip_to (at);
+                if (p != at)
+                    return;
+                size_t copies = cover();
+                if (copies == 0)
+                    return;
+                ctr.count_pileup (pl, n, n_plp);
+                emit (c.reg.rid, p++, copies);
+            });
+        skip_to (c.reg.end);
+    }
+    if (n)
+        flush();
+}
@@ -0,0 +1,163 @@
+// Copyright 2025 (c) Alex Byrne (alex@blex.bio), Luca Barbon; CASM
+// Informatics, Wellcome Sanger Institute. All rights reserved. Use of
+// this source code is governed by the MIT license that can be found
+// in the LICENSE file.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <htslib/sam.h>
+#include <string>
+#include <sys/resource.h>
+
+#include "pileup.hpp"
+
+inline uint64_t stats_now_ns () {
+    return static_cast<uint64_t> (
+        std::chrono::duration_cast<std::chrono::nanoseconds> (
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+// what one pileup saw, gathered without synchronisation and added to
+// the run's totals once it finishes
+struct read_tally {
+    uint64_t fetched = 0;
+    uint64_t rejected_exclude = 0;
+    uint64_t rejected_include = 0;
+    uint64_t rejected_mapq = 0;
+    uint64_t rejected_downsample = 0; // see pileup_func
+    uint64_t columns_in = 0;
+    uint64_t columns_out = 0;
+    uint64_t columns_max_depth = 0;
+    uint64_t ns_query = 0;
+    uint64_t ns_pileup = 0; // reading, decoding, filtering and piling up
+    uint64_t ns_count = 0; // handling columns, including any output
+
+    // add the time since mark to bucket, moving mark on
+    void lap (uint64_t &bucket,
+              uint64_t &mark) {
+        uint64_t now = stats_now_ns();
+        bucket += now - mark;
+        mark = now;
+    }
+};
+
+// the first reason a read fails the filters of pileup_func, if any
+inline void tally_read (read_tally &t,
+                        const bam1_t *b,
+                        const count_params &p) {
+    ++t.fetched;
+    if (b->core.flag & p.exclude_flag)
+        ++t.rejected_exclude;
+    else if ((b->core.flag & p.include_flag) != p.include_flag)
+        ++t.rejected_include;
+    else if (b->core.qual < p.min_mapq)
+        ++t.rejected_mapq;
+}
+
+// totals of a whole run, shared by every pileup and worker
+struct run_stats {
+    std::atomic<uint64_t> reads_fetched{0};
+    // decoded by --downsample-depth's scan, again when counted
+    std::atomic<uint64_t> reads_depth_scanned{0};
+    std::atomic<uint64_t> rejected_exclude{0};
+    std::atomic<uint64_t> rejected_include{0};
+    std::atomic<uint64_t> rejected_mapq{0};
+    std::atomic<uint64_t> rejected_downsample{0};
+    std::atomic<uint64_t> columns_in{0};
+    std::atomic<uint64_t> columns_out{0};
+    std::atomic<uint64_t> columns_max_depth{0};
+    std::atomic<uint64_t> ns_setup{0};
+    std::atomic<uint64_t> ns_query{0};
+    std::atomic<uint64_t> ns_depth_scan{0};
+    std::atomic<uint64_t> ns_pileup{0};
+    std::atomic<uint64_t> ns_count{0};
+    std::atomic<uint64_t> ns_output{0};
+    std::atomic<uint64_t> ns_total{0};
+
+    void add (const read_tally &t) {
+        reads_fetched += t.fetched;
+        rejected_exclude += t.rejected_exclude;
+        rejected_include += t.rejected_include;
+        rejected_mapq += t.rejected_mapq;
+        rejected_downsample += t.rejected_downsample;
+        columns_in += t.columns_in;
+        columns_out += t.columns_out;
+        columns_max_depth += t.columns_max_depth;
+        add_times (t);
+    }
+
+    // for work that is redone, so counted only once
+    void add_times (const read_tally &t) {
+        ns_query += t.ns_query;
+        ns_pileup += t.ns_pileup;
+        ns_count += t.ns_count;
+    }
+};
+
+// adds the time until it is destroyed to bucket, if not null
+class stage_timer {
+  private:
+    std::atomic<uint64_t> *bucket;
+    uint64_t start;
+
+  public:
+    explicit stage_timer (std::atomic<uint64_t> *bucket_)
+        : bucket (bucket_), start (bucket_ ? stats_now_ns() : 0) {}
+    stage_timer (const stage_timer &) = delete;
+    stage_timer &operator= (const stage_timer &) = delete;
+    ~stage_timer () {
+        if (bucket)
+            *bucket += stats_now_ns() - start;
+    }
+};
+
+// peak resident set size of the process so far, in KiB
+inline uint64_t peak_rss_kib () {
+    struct rusage ru;
+    if (getrusage (RUSAGE_SELF, &ru) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t> (ru.ru_maxrss) / 1024; // bytes
+#else
+    return static_cast<uint64_t> (ru.ru_maxrss);
+#endif
+}
+
+// one JSON object. Stage times are summed over workers, so may exceed
+// total when counting in parallel; count includes any output done
+// while counting, which output also reports alone
+inline std::string run_stats_json (const run_stats &s) {
+    auto sec = [] (const std::atomic<uint64_t> &ns) {
+        return std::to_string (static_cast<double> (ns.load()) / 1e9);
+    };
+    auto num = [] (const std::atomic<uint64_t> &n) {
+        return std::to_string (n.load());
+    };
+    // clang-format off
+    return std::string ("{") +
+        "\"reads_fetched\":" + num (s.reads_fetched) + "," +
+        "\"reads_depth_scanned\":" + num (s.reads_depth_scanned) + "," +
+        "\"reads_rejected\":{" +
+            "\"exclude_flag\":" + num (s.rejected_exclude) + "," +
+            "\"include_flag\":" + num (s.rejected_include) + "," +
+            "\"mapq\":" + num (s.rejected_mapq) + "," +
+            "\"downsampled\":" + num (s.rejected_downsample) + "}," +
+        "\"columns\":{" +
+            "\"in_region\":" + num (s.columns_in) + "," +
+            "\"outside_region\":" + num (s.columns_out) + "," +
+            "\"at_max_depth\":" + num (s.columns_max_depth) + "}," +
+        "\"seconds\":{" +
+            "\"setup\":" + sec (s.ns_setup) + "," +
+            "\"index_query\":" + sec (s.ns_query) + "," +
+            "\"depth_scan\":" + sec (s.ns_depth_scan) + "," +
+            "\"read_pileup\":" + sec (s.ns_pileup) + "," +
+            "\"count\":" + sec (s.ns_count) + "," +
+            "\"output\":" + sec (s.ns_output) + "," +
+            "\"total\":" + sec (s.ns_total) + "}," +
+        "\"peak_rss_kib\":" + std::to_string (peak_rss_kib()) + "}";
+    // clang-format on
+}
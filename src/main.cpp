@@ -7,6 +7,7 @@
 #include <cstdint>
 #include <cstring>
 #include <cxxopts.hpp>
+#include <fstream>
 #include <htslib/hts.h>
 #include <htslib/sam.h>
 #include <iostream>
@@ -15,15 +16,34 @@
 #include <string>
 #include <vector>
 
+#include "aln.hpp"
+#include "cache.hpp"
 #include "const.hpp"
 #include "count.hpp"
+#include "multi.hpp"
+#include "output.hpp"
+#include "parallel.hpp"
+#include "planner.hpp"
+#include "regions.hpp"
+#include "sites.hpp"
+#include "stats.hpp"
 
 int main (int argc,
           char *argv[]) {
     namespace fs = std::filesystem;
+    uint64_t start_ns = stats_now_ns();
 
     fs::path aln_path;
     std::string region_str;
+    fs::path regions_path;
+    bool batch = false;
+    fs::path samples_path;
+    bool multi = false;
+    fs::path sites_path;
+    bool by_site = false;
+    int64_t site_gap = SITE_CLUSTER_GAP;
+    int64_t merge_gap = -1;
+    bool whole_file = false;
     count_params cp;
     cp.min_mapq = 25;
     cp.min_baseq = 30;
@@ -33,7 +53,21 @@ int main (int argc,
     cp.clip_bound = 0;
     bool print_head = false;
     bool print_row = false;
+    bool print_chrom = false;
     bool no_overlaps = false;
+    std::string out_path = "-";
+    bool out_bgzf = false;
+    bool out_tsv = false;
+    bool out_bin = false;
+    RowFilter row_filter = RowFilter::all;
+    size_t n_jobs = 1;
+    int n_threads = 0;
+    std::string reference;
+    std::string ref_cache;
+    std::string cache_dir;
+    uint64_t cache_mib = CACHE_DEFAULT_MIB;
+    run_stats stats;
+    std::string stats_path;
 
     try {
         cxxopts::Options options (
@@ -104,8 +138,10 @@ int main (int argc,
 
         // clang-format off
         options.add_options()
-            ("aln", "", cxxopts::value<fs::path>())  // positional
-            ("region", "", cxxopts::value<std::string>())
+            // positionals, assigned once the mode is known: strings,
+            // as a region is not a path
+            ("pos1", "", cxxopts::value<std::string>())
+            ("pos2", "", cxxopts::value<std::string>())
 
             // parameters
             ("b,baseq",
@@ -126,16 +162,76 @@ int main (int argc,
             ("d,depth",
              "Maximum read depth (default 1000000)",
              cxxopts::value<int>())
+            ("fraction",
+             "Keep this fraction of templates, chosen by a hash of the read name so mates stay together and runs repeat",
+             cxxopts::value<double>())
+            ("downsample-depth",
+             "Downsample templates, as --fraction, so the deepest position of each region is about <downsample-depth> reads",
+             cxxopts::value<int>())
+            ("seed",
+             "Seed of the read name hash downsampling by (default 0)",
+             cxxopts::value<uint64_t>())
+            ("j,jobs",
+             "Split each region into <jobs> shards counted in parallel, or with --samples count <jobs> sample regions at once. Output equals a serial run's except at positions truncated by --depth (default 1)",
+             cxxopts::value<int>())
+            ("t,threads",
+             "Number of additional threads for decompression, shared between all open files (default 0)",
+             cxxopts::value<int>())
+            ("reference",
+             "Reference fasta used to decode CRAM input",
+             cxxopts::value<std::string>())
+            ("ref-cache",
+             "Local directory used as the CRAM reference cache (REF_CACHE)",
+             cxxopts::value<std::string>())
+            ("cache",
+             "Keep the counts of each region in directory <cache>, and reuse them when the same file, region and parameters are counted again",
+             cxxopts::value<std::string>())
+            ("cache-size",
+             "Size bound in MiB of the --cache directory, least recently used entries being removed beyond it (default 1024)",
+             cxxopts::value<int>())
+            ("r,regions",
+             "File of regions to count in place of <region>, one per line as BED or chr:start-end. Rows are prefixed with their region",
+             cxxopts::value<fs::path>())
+            ("merge-gap",
+             "With --regions, count regions within <merge-gap> bp of each other through one index query and pileup, reporting the savings to stderr. Output is then in genomic order. Implies --row",
+             cxxopts::value<int64_t>())
+            ("whole-file",
+             "Count every position covered in the whole file, in one linear pass without an index, in place of <region>. Implies --chrom --row")
+            ("sites",
+             "Sorted VCF or BED of sites to count in place of <region>, with a row per site. Implies --chrom --row",
+             cxxopts::value<fs::path>())
+            ("site-gap",
+             "With --sites, count sites up to <site-gap> bp apart in one pileup, or -1 for one per contig (default 1000)",
+             cxxopts::value<int64_t>())
+            ("s,samples",
+             "File of alignment files, one per line, each counted over the same region(s) in place of <.BAM/.CRAM>. Rows are prefixed with their sample",
+             cxxopts::value<fs::path>())
 
             ("head", "Print header")
             ("row", "Print genomic position index for each row")
+            ("chrom", "Print contig name for each row")
+            ("o,output", "Write output to file rather than stdout", cxxopts::value<std::string>())
+            ("z,bgzf", "BGZF compress output. With --chrom --row --tsv the output can be indexed by tabix")
+            ("tsv", "Separate columns with tabs rather than commas")
+            ("sparse",
+             "Only print covered rows, or with --sparse=variant only rows with evidence beyond the majority allele. Implies --row",
+             cxxopts::value<std::string>()->implicit_value ("covered"))
+            ("f,format",
+             "Output format: csv, or bin for a uint32 matrix with a JSON header that can be memory mapped (default csv)",
+             cxxopts::value<std::string>())
             ("discard-overlaps", "Avoid double counting of bases from the same template")
+            ("stats",
+             "Report reads fetched and rejected, columns counted, stage timings and peak memory as JSON on stderr, or with --stats=FILE in a file",
+             cxxopts::value<std::string>()->implicit_value ("-"))
             ("h,help", "Print usage")
             ("version", "Print program version");  // ideally this would report the version of htslib compiled against
         // clang-format on
 
-        options.parse_positional ({"aln", "region"});
-        options.positional_help ("<.BAM/.CRAM> chr:start-end");
+        options.parse_positional ({"pos1", "pos2"});
+        options.positional_help (
+            "<.BAM/.CRAM> | -s <samples file>  chr:start-end | "
+            "-r <regions file> | --sites <vcf/bed> | "
+            "--whole-file");
         auto parsed_args = options.parse (argc, argv);
 
         if (parsed_args.count ("help")) {
@@ -148,20 +244,106 @@ int main (int argc,
             return 0;
         }
 
-        if ((!parsed_args.count ("aln")) ||
-            (!parsed_args.count ("region"))) {
+        batch = parsed_args.count ("regions") > 0;
+        multi = parsed_args.count ("samples") > 0;
+        by_site = parsed_args.count ("sites") > 0;
+        // <aln> [region], or with --samples only [region]
+        std::vector<std::string> positional;
+        for (const char *pos : {"pos1", "pos2"}) {
+            if (parsed_args.count (pos))
+                positional.push_back (
+                    parsed_args[pos].as<std::string>());
+        }
+        // --sparse and --stats take their value only as --opt=value,
+        // so "--sparse variant" or "--stats FILE" leave it positional
+        std::vector<std::string> stray = parsed_args.unmatched();
+        stray.insert (stray.begin(), positional.begin(),
+                      positional.end());
+        for (const std::string &arg : stray) {
+            if (arg == "covered" || arg == "variant") {
+                std::cout << "incorrect usage: " << arg
+                          << " given as a positional argument, for a "
+                             "--sparse mode write --sparse="
+                          << arg << ". Try --help" << std::endl;
+                return 1;
+            }
+        }
+        if (!parsed_args.unmatched().empty()) {
+            std::cout << "incorrect usage: unexpected argument "
+                      << parsed_args.unmatched()[0]
+                      << " (give --stats a file as --stats=FILE). "
+                         "Try --help"
+                      << std::endl;
+            return 1;
+        }
+        size_t n_aln = multi ? 0 : 1;
+        bool have_region = positional.size() > n_aln;
+        // streams the whole file, index-free. Asked for explicitly,
+        // so a forgotten region is not a genome-wide run
+        whole_file = parsed_args.count ("whole-file") > 0;
+        if (positional.size() < n_aln ||
+            (!have_region && !batch && !by_site && !whole_file)) {
             std::cout << "incorrect usage: all postional arguments "
                          "required. Try --help"
                       << std::endl;
             return 1;
         }
+        if (positional.size() > n_aln + 1) {
+            std::cout << "incorrect usage: with --samples provide "
+                         "only a region. Try --help"
+                      << std::endl;
+            return 1;
+        }
+        if (have_region + batch + by_site + whole_file > 1) {
+            std::cout << "incorrect usage: provide one of a region, "
+                         "--regions, --sites or --whole-file. Try "
+                         "--help"
+                      << std::endl;
+            return 1;
+        }
+        if ((by_site || whole_file) && multi) {
+            std::cout << "incorrect usage: --sites and --whole-file "
+                         "count a single alignment file. Try --help"
+                      << std::endl;
+            return 1;
+        }
 
-        aln_path = parsed_args["aln"].as<fs::path>();
-        region_str = parsed_args["region"].as<std::string>();
+        if (multi) {
+            samples_path = parsed_args["samples"].as<fs::path>();
+        } else {
+            aln_path = positional[0];
+            // stdin and URLs are left to htslib
+            std::error_code ec;
+            if (positional[0] != "-" &&
+                positional[0].find ("://") == std::string::npos &&
+                !fs::exists (aln_path, ec)) {
+                std::cout << "incorrect usage: alignment file "
+                          << positional[0]
+                          << " not found (give --stats a file as "
+                             "--stats=FILE). Try --help"
+                          << std::endl;
+                return 1;
+            }
+        }
+        if (batch) {
+            regions_path = parsed_args["regions"].as<fs::path>();
+        } else if (by_site) {
+            sites_path = parsed_args["sites"].as<fs::path>();
+            if (parsed_args.count ("site-gap"))
+                site_gap = parsed_args["site-gap"].as<int64_t>();
+            // rows no longer follow from order
+            print_row = true;
+            print_chrom = true;
+        } else if (whole_file) {
+            print_row = true;
+            print_chrom = true;
+        } else {
+            region_str = positional[n_aln];
 
-        if (region_str.empty())
-            throw std::runtime_error (
-                "region string appears to be empty");
+            if (region_str.empty())
+                throw std::runtime_error (
+                    "region string appears to be empty");
+        }
 
         if (parsed_args.count ("baseq")) {
             cp.min_baseq = parsed_args["baseq"].as<int>();
@@ -181,15 +363,139 @@ int main (int argc,
         if (parsed_args.count ("depth")) {
             cp.max_depth = parsed_args["depth"].as<int>();
         }
+        if (parsed_args.count ("fraction") &&
+            parsed_args.count ("downsample-depth")) {
+            throw std::runtime_error (
+                "--fraction and --downsample-depth are exclusive");
+        }
+        if (parsed_args.count ("fraction")) {
+            double f = parsed_args["fraction"].as<double>();
+            if (!(f > 0.0 && f <= 1.0))
+                throw std::runtime_error (
+                    "--fraction must be in (0, 1]");
+            cp.keep_below = keep_threshold (f);
+        }
+        if (parsed_args.count ("downsample-depth")) {
+            cp.downsample_depth =
+                parsed_args["downsample-depth"].as<int>();
+            if (cp.downsample_depth < 1)
+                throw std::runtime_error (
+                    "--downsample-depth must be at least 1");
+            if (whole_file)
+                throw std::runtime_error (
+                    "--downsample-depth needs a region");
+        }
+        if (parsed_args.count ("seed")) {
+            cp.downsample_seed = parsed_args["seed"].as<uint64_t>();
+        }
+        if (parsed_args.count ("jobs")) {
+            int j = parsed_args["jobs"].as<int>();
+            if (j < 1)
+                throw std::runtime_error ("--jobs must be at least 1");
+            n_jobs = static_cast<size_t> (j);
+        }
+        if (parsed_args.count ("threads")) {
+            n_threads = parsed_args["threads"].as<int>();
+            if (n_threads < 0)
+                throw std::runtime_error (
+                    "--threads must not be negative");
+        }
+        if (parsed_args.count ("reference")) {
+            reference = parsed_args["reference"].as<std::string>();
+        }
+        if (parsed_args.count ("ref-cache")) {
+            ref_cache = parsed_args["ref-cache"].as<std::string>();
+        }
         if (parsed_args.count ("head")) {
             print_head = true;
         }
         if (parsed_args.count ("row")) {
             print_row = true;
         }
+        if (parsed_args.count ("chrom")) {
+            print_chrom = true;
+        }
+        if (parsed_args.count ("output")) {
+            out_path = parsed_args["output"].as<std::string>();
+        }
+        if (parsed_args.count ("bgzf")) {
+            out_bgzf = true;
+        }
+        if (parsed_args.count ("tsv")) {
+            out_tsv = true;
+        }
+        if (parsed_args.count ("format")) {
+            auto fmt = parsed_args["format"].as<std::string>();
+            if (fmt == "bin") {
+                out_bin = true;
+            } else if (fmt != "csv") {
+                throw std::runtime_error ("unknown --format " + fmt);
+            }
+        }
+        if (parsed_args.count ("sparse")) {
+            auto mode = parsed_args["sparse"].as<std::string>();
+            if (mode == "covered") {
+                row_filter = RowFilter::covered;
+            } else if (mode == "variant") {
+                row_filter = RowFilter::variant;
+            } else {
+                throw std::runtime_error ("unknown --sparse mode " +
+                                          mode);
+            }
+            print_row = true; // rows no longer follow from order
+        }
+        if (out_bin && (out_bgzf || out_tsv || print_chrom)) {
+            throw std::runtime_error (
+                "--bgzf, --tsv, --chrom, --sites and whole file "
+                "streaming only apply to csv output");
+        }
+        if (parsed_args.count ("merge-gap")) {
+            merge_gap = parsed_args["merge-gap"].as<int64_t>();
+            if (merge_gap < 0)
+                throw std::runtime_error (
+                    "--merge-gap must not be negative");
+            if (!batch || n_jobs > 1 || multi) {
+                throw std::runtime_error (
+                    "--merge-gap only applies to --regions without "
+                    "--jobs or --samples");
+            }
+            // merged regions' rows arrive by plan, not in file order
+            print_row = true;
+        }
+        // one query spans several regions or sites, so its depth
+        // would pick the fraction for all of them
+        if (cp.downsample_depth > 0 && (merge_gap >= 0 || by_site)) {
+            throw std::runtime_error (
+                "--downsample-depth does not apply to --merge-gap or "
+                "--sites, use --fraction");
+        }
+        if ((by_site || whole_file) && n_jobs > 1) {
+            throw std::runtime_error (
+                "--jobs does not apply to --sites or whole file "
+                "streaming");
+        }
+        if (parsed_args.count ("cache")) {
+            cache_dir = parsed_args["cache"].as<std::string>();
+            if (multi || by_site || whole_file || merge_gap >= 0) {
+                throw std::runtime_error (
+                    "--cache only applies to a region or --regions "
+                    "without --merge-gap");
+            }
+        }
+        if (parsed_args.count ("cache-size")) {
+            int mib = parsed_args["cache-size"].as<int>();
+            if (mib < 1)
+                throw std::runtime_error (
+                    "--cache-size must be at least 1");
+            cache_mib = static_cast<uint64_t> (mib);
+        }
         if (parsed_args.count ("discard-overlaps")) {
             no_overlaps = true;
         }
+        if (parsed_args.count ("stats")) {
+            stats_path = parsed_args["stats"].as<std::string>();
+            cp.stats = &stats;
+        }
 
     } catch (const std::exception &e) {
         std::cerr << "Error parsing CLI options: " << e.what()
@@ -197,107 +503,359 @@ int main (int argc,
         return 1;
     }
 
+    // declared first so it outlives every file attached to it
+    std::unique_ptr<HtsThreadPool> pool;
     htsFile *aln_in=nullptr;
     bam_hdr_t *head=nullptr;
-    hts_region reg;
     hts_idx_t *idx=nullptr;
-    int tid = -3;
-    int64_t start, end;
-    std::vector<int> result;
+    std::vector<named_region> regions;
+    std::vector<std::string> contigs;
+    std::vector<std::string> samples;
+    sample_set sample_units;
+    std::vector<site> sites;
+    std::unique_ptr<ResultCache> cache;
+    aln_opts ao;
+    ao.reference = reference;
+    // CRAM qnames are decoded only when downsampling hashes them
+    ao.read_names =
+        cp.keep_below != UINT64_MAX || cp.downsample_depth > 0;
     try {
-        aln_in = hts_open (aln_path.c_str(), "r");
-        if (aln_in == NULL) {
-            throw std::runtime_error (
-                "failed to read alignment file");
-        }
-        head = sam_hdr_read (aln_in);
-        if (head == NULL) {
-            throw std::runtime_error (
-                "failed to get header from alignment file");
-        }
+        use_ref_cache (ref_cache);
+        if (!cache_dir.empty())
+            cache = std::make_unique<ResultCache> (cache_dir, cache_mib);
+        pool = std::make_unique<HtsThreadPool> (n_threads);
+        ao.pool = pool.get();
+        if (multi) {
+            // each sample's header and index are loaded once, and
+            // the regions parsed against each
+            samples = read_sample_list (samples_path);
+            std::vector<std::string> region_lines;
+            if (batch) {
+                for (auto &[line_no, line] :
+                     read_region_lines (regions_path))
+                    region_lines.push_back (line);
+            } else {
+                region_lines.push_back (region_str);
+            }
+            sample_units = load_samples (samples, region_lines,
+                                         AEVSettings{no_overlaps},
+                                         n_jobs, ao);
+            regions = sample_units.layout.regions;
+            contigs = sample_units.layout.contigs;
+        } else {
+            aln_in = open_alignment (aln_path.string(),
+                                     AEVSettings{no_overlaps}, ao);
+            head = sam_hdr_read (aln_in);
+            if (head == NULL) {
+                throw std::runtime_error (
+                    "failed to get header from alignment file");
+            }
 
-        auto rp =
-            sam_parse_region (head, region_str.c_str(), &tid, &start,
-                              &end, HTS_PARSE_ONE_COORD);
-        if (rp == NULL) {
-            std::string msg;
-            switch (tid) {
-                case -2:
-                    msg = "memory error";
-                    break;
-                case -1:
-                    msg = "could not parse contig";
-                    break;
-                default:
-                    msg = "specified range could not be parsed";
+            if (batch) {
+                regions = read_regions_file (head, regions_path);
+            } else if (by_site) {
+                sites = read_sites_file (head, sites_path);
+            } else if (whole_file) {
+                // read sequentially, no index needed
+            } else {
+                hts_region reg;
+                try {
+                    reg = parse_region (head, region_str);
+                } catch (std::exception &e) {
+                    std::cout << "incorrect usage: " << e.what()
+                              << ". Try --help" << std::endl;
+                    return 1;
+                }
+                regions.push_back (named_region{region_str, reg});
             }
-            throw std::runtime_error (
-                "parse failed for input region " + region_str +
-                " - " + msg);
-        }
-        // converts to 0-indexed internal postions from 1-indexed
-        // region str
-        reg = hts_region::by_end (tid, start, end);
+            for (const named_region &nr : regions)
+                contigs.push_back (sam_hdr_tid2name (head, nr.reg.rid));
 
-        idx = sam_index_load (aln_in, aln_path.c_str());
-        if (idx == NULL) {
-            throw std::runtime_error ("failed to load index file");
+            // loaded once and reused for every region
+            if (!whole_file)
+                idx = sam_index_load (aln_in, aln_path.c_str());
+            if (idx == NULL && !whole_file) {
+                throw std::runtime_error ("failed to load index file");
+            }
         }
-
-        safe_size_opts sso;
-        sso.msg =
-            "error in calculating cells needed for storing result";
-        size_t n_cells = safe_size (
-            static_cast<int64_t> (reg.rlen * N_FIELDS_PER_OBS));
-        result.resize (n_cells, 0);
-
     } catch (std::exception &e) {
         std::cerr << "Error during setup: " << e.what() << std::endl;
         return 1;
     }
+    stats.ns_setup = stats_now_ns() - start_ns;
+    // output is timed only when asked for, being per row
+    std::atomic<uint64_t> *output_ns =
+        cp.stats ? &stats.ns_output : nullptr;
 
+    // csv, or a binary matrix whose header carries the column names,
+    // parameters and region table so needs no --head
+    std::unique_ptr<RowWriter> out;
+    std::unique_ptr<MatrixWriter> out_mat;
     try {
-        AlleleEventCounter aev (cp, result, AEVSettings{no_overlaps});
-        count (aln_in, idx, aev, reg, cp);
+        if (out_bin) {
+            std::vector<std::string> prefix_cols;
+            if (multi)
+                prefix_cols.push_back ("sample");
+            if (batch)
+                prefix_cols.push_back ("region");
+            if (print_row)
+                prefix_cols.push_back ("pos");
+            std::vector<matrix_region> mat_regions;
+            for (size_t ri = 0; ri < regions.size(); ++ri) {
+                mat_regions.push_back (matrix_region{
+                    regions[ri].name, contigs[ri],
+                    regions[ri].reg.start + 1, regions[ri].reg.end});
+            }
+            // row offsets hold only when every row of each region
+            // is written, region by region in file order
+            bool dense = row_filter == RowFilter::all && merge_gap < 0;
+            out_mat = std::make_unique<MatrixWriter> (
+                out_path,
+                matrix_header_json (prefix_cols, mat_regions, cp,
+                                    AEVSettings{no_overlaps}, dense,
+                                    samples));
+        } else {
+            out = std::make_unique<RowWriter> (out_path, out_bgzf,
+                                               out_tsv ? '\t' : ',');
+            if (print_head) {
+                if (multi)
+                    out->cell ("sample");
+                if (batch)
+                    out->cell ("region");
+                if (print_chrom)
+                    out->cell ("chrom");
+                if (print_row)
+                    out->cell ("pos");
+                out->header();
+            }
+        }
     } catch (std::exception &e) {
-        std::cerr << "Error during calculation: " << e.what()
-                  << std::endl;
+        std::cerr << "Error during write: " << e.what() << std::endl;
         return 1;
     }
 
-    // NOTE: may also want to optionally include rid in output with
-    // pos
-    try {
-        if (print_head) {
+    // rows of region ri, of sample si when counting several
+    auto write_rows = [&] (size_t si, size_t ri, size_t first_row,
+                           const int *rows, size_t n_rows) {
+        stage_timer timer (output_ns);
+        const named_region &nr = regions[ri];
+        // adds 1 for 1-indexed row to match input region string
+        uint64_t pos =
+            static_cast<uint64_t> (nr.reg.start) + first_row + 1;
+        for (size_t r = 0; r < n_rows; ++r, ++pos) {
+            if (out_mat) {
+                if (multi)
+                    out_mat->cell (si);
+                if (batch)
+                    out_mat->cell (ri);
+                if (print_row)
+                    out_mat->cell (pos);
+                out_mat->counts (rows + r * N_FIELDS_PER_OBS);
+                continue;
+            }
+            if (multi)
+                out->cell (samples[si]);
+            if (batch)
+                out->cell (nr.name);
+            if (print_chrom)
+                out->cell (contigs[ri]);
             if (print_row)
-                std::cout << "pos,";
-            std::cout << HEADER << "\n";
+                out->cell (pos);
+            out->counts (rows + r * N_FIELDS_PER_OBS);
         }
-        size_t i = 0;
-        size_t row_counter = 1; // adds 1 for 1-indexed row to match
-                                // input region string
-        while (i < result.size()) {
-            if (print_row)
-                std::cout
-                    << static_cast<uint64_t> (reg.start) + row_counter
-                    << ",";
-            size_t j = 0;
-            while (j < (N_FIELDS_PER_OBS - 1)) {
-                std::cout << result[i + j] << ",";
-                ++j;
+    };
+
+    // (sample, region) units are counted on n_jobs workers and each
+    // written in order as it completes, so only the units counted
+    // ahead are held rather than the whole sample-stacked matrix
+    if (multi) {
+        try {
+            stream_samples (
+                sample_units, cp, AEVSettings{no_overlaps}, n_jobs, ao,
+                [&] (size_t si, size_t ri, const int *rows) {
+                    sink_filtered (
+                        row_filter,
+                        [&] (size_t first_row, const int *block,
+                             size_t n_rows) {
+                            write_rows (si, ri, first_row, block,
+                                        n_rows);
+                        },
+                        0, rows, regions[ri].reg.rlen);
+                });
+        } catch (std::exception &e) {
+            std::cerr << "Error during calculation: " << e.what()
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    // one pileup per cluster of nearby sites, counting only at sites
+    if (by_site) {
+        auto site_rows = [&] (const int32_t *tids,
+                              const int64_t *positions, const int *rows,
+                              size_t n_rows) {
+            stage_timer timer (output_ns);
+            for (size_t r = 0; r < n_rows; ++r) {
+                out->cell (sam_hdr_tid2name (head, tids[r]));
+                // adds 1 for 1-indexed row, as in a VCF
+                out->cell (static_cast<uint64_t> (positions[r]) + 1);
+                out->counts (rows + r * N_FIELDS_PER_OBS);
             }
-            std::cout << result[i + j] << "\n";
-            i += N_FIELDS_PER_OBS;
-            ++row_counter;
+        };
+        try {
+            count_sites (aln_in, idx, sites, cp,
+                         AEVSettings{no_overlaps}, site_rows,
+                         row_filter, site_gap);
+        } catch (std::exception &e) {
+            std::cerr << "Error during calculation: " << e.what()
+                      << std::endl;
+            return 1;
         }
+    }
+
+    // one linear pass over every contig in file order
+    if (whole_file) {
+        auto located_rows = [&] (const int32_t *tids,
+                                 const int64_t *positions,
+                                 const int *rows, size_t n_rows) {
+            stage_timer timer (output_ns);
+            for (size_t r = 0; r < n_rows; ++r) {
+                out->cell (sam_hdr_tid2name (head, tids[r]));
+                out->cell (static_cast<uint64_t> (positions[r]) + 1);
+                out->counts (rows + r * N_FIELDS_PER_OBS);
+            }
+        };
+        try {
+            count_file_streaming (aln_in, head, cp,
+                                  AEVSettings{no_overlaps}, located_rows,
+                                  row_filter);
+        } catch (std::exception &e) {
+            std::cerr << "Error during calculation: " << e.what()
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    // nearby regions share one query and pileup
+    if (merge_gap >= 0) {
+        std::vector<hts_region> regs;
+        for (const named_region &nr : regions)
+            regs.push_back (nr.reg);
+        plan_stats plan;
+        try {
+            count_planned (aln_in, idx, regs,
+                           plan_regions (regs, merge_gap), cp,
+                           AEVSettings{no_overlaps},
+                           [&] (size_t ri, size_t first_row,
+                                const int *rows, size_t n_rows) {
+                               write_rows (0, ri, first_row, rows,
+                                           n_rows);
+                           },
+                           row_filter, &plan);
+        } catch (std::exception &e) {
+            std::cerr << "Error during calculation: " << e.what()
+                      << std::endl;
+            return 1;
+        }
+        std::cerr << "merged " << plan.regions << " regions into "
+                  << plan.queries << " queries (" << plan.seeks_saved()
+                  << " seeks saved); decoded " << plan.reads_fetched
+                  << " reads against " << plan.reads_unplanned
+                  << " unmerged (" << plan.reads_saved()
+                  << " saved)" << std::endl;
+    }
+
+    bool per_region = !multi && merge_gap < 0;
+    for (size_t ri = 0; ri < regions.size() && per_region; ++ri) {
+        const hts_region &reg = regions[ri].reg;
+        auto region_rows = [&] (size_t first_row, const int *rows,
+                                size_t n_rows) {
+            write_rows (0, ri, first_row, rows, n_rows);
+        };
+
+        // rows are written as they complete, so memory does not
+        // scale with region length. A cached region is replayed in
+        // blocks, or stored unfiltered as it is counted, then filtered
+        // as it is written
+        try {
+            std::unique_ptr<ResultCache::Writer> entry;
+            row_sink sink = region_rows;
+            RowFilter filter = row_filter;
+            if (cache) {
+                std::string key = cache_key (aln_path.string(), reg, cp,
+                                             AEVSettings{no_overlaps});
+                if (cache->replay (
+                        key, reg.rlen * N_FIELDS_PER_OBS,
+                        [&] (size_t first_cell, const int *cells,
+                             size_t n_cells) {
+                            sink_filtered (row_filter, region_rows,
+                                           first_cell / N_FIELDS_PER_OBS,
+                                           cells,
+                                           n_cells / N_FIELDS_PER_OBS);
+                        },
+                        STREAM_WINDOW_ROWS * N_FIELDS_PER_OBS))
+                    continue;
+                entry = std::make_unique<ResultCache::Writer> (
+                    *cache, key, reg.rlen * N_FIELDS_PER_OBS);
+                sink = [&] (size_t first_row, const int *rows,
+                            size_t n_rows) {
+                    entry->put (rows, n_rows * N_FIELDS_PER_OBS);
+                    sink_filtered (row_filter, region_rows, first_row,
+                                   rows, n_rows);
+                };
+                filter = RowFilter::all;
+            }
+            if (n_jobs > 1) {
+                // one fraction for the region, not one per shard
+                count_sharded_streaming (
+                    aln_path.string(), idx, reg,
+                    downsample_params (aln_in, idx, reg, cp),
+                    AEVSettings{no_overlaps}, n_jobs, sink, ao, filter);
+            } else {
+                count_streaming (aln_in, idx, reg, cp,
+                                 AEVSettings{no_overlaps}, sink, filter);
+            }
+            if (entry)
+                entry->commit();
+        } catch (std::exception &e) {
+            std::cerr << "Error during calculation: " << e.what()
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    try {
+        stage_timer timer (output_ns);
+        if (out_mat)
+            out_mat->close();
+        else
+            out->close();
     } catch (std::exception &e) {
         std::cerr << "Error during write: " << e.what() << std::endl;
         return 1;
     }
 
-    hts_close (aln_in);
-    bam_hdr_destroy (head);
-    hts_idx_destroy (idx);
+    if (aln_in) {
+        hts_close (aln_in);
+        bam_hdr_destroy (head);
+        if (idx)
+            hts_idx_destroy (idx);
+    }
+
+    if (cp.stats) {
+        stats.ns_total = stats_now_ns() - start_ns;
+        if (stats_path == "-") {
+            std::cerr << run_stats_json (stats) << std::endl;
+        } else {
+            std::ofstream sf (stats_path);
+            sf << run_stats_json (stats) << '\n';
+            if (!sf) {
+                std::cerr << "Error during write: failed to write "
+                          << stats_path << std::endl;
+                return 1;
+            }
+        }
+    }
 
     return 0;
 }
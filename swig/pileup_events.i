@@ -5,13 +5,290 @@
 %}
 
 %include "std_string.i"  // for parameters to count_events
-%include "std_vector.i"  // for result of count_events
+%include "std_vector.i"  // for vector parameters
+%include "exception.i"
 
-/* tell SWIG how to convert std::vector<int> */
-%include "std_vector.i"
 namespace std {
   %template(IntVector) vector<int>;
+  %template(StringVector) vector<string>;
 }
 
+/* surface C++ errors as errors of the host language */
+%exception {
+  try {
+    $action
+  } catch (const std::exception &e) {
+    SWIG_exception (SWIG_RuntimeError, e.what ());
+  }
+}
+
+/* buffer based entry points used by the typemaps below */
+%ignore PileupReader::count_into;
+%ignore vector_alloc;
+
+#ifdef SWIGPYTHON
+/* counts are returned as a (rows, 24) int32 numpy array which takes
+   over the result's buffer, so no copy is made. Column names are given
+   by count_columns() */
+%{
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+static void pev_free_counts (PyObject *capsule) {
+  delete static_cast<std::vector<int> *> (
+      PyCapsule_GetPointer (capsule, "pileup_events.counts"));
+}
+
+// new reference to an array owning counts, or NULL with an error set
+static PyObject *pev_counts_array (std::vector<int> &&counts) {
+  auto *cells = new std::vector<int> (std::move (counts));
+  npy_intp dims[2] = {
+      static_cast<npy_intp> (cells->size () / N_FIELDS_PER_OBS),
+      static_cast<npy_intp> (N_FIELDS_PER_OBS)};
+  PyObject *arr =
+      PyArray_SimpleNewFromData (2, dims, NPY_INT, cells->data ());
+  if (arr == NULL) {
+    delete cells;
+    return NULL;
+  }
+  PyObject *owner =
+      PyCapsule_New (cells, "pileup_events.counts", pev_free_counts);
+  if (owner == NULL) {
+    delete cells;
+    Py_DECREF (arr);
+    return NULL;
+  }
+  /* steals owner, which frees cells along with the array */
+  if (PyArray_SetBaseObject (reinterpret_cast<PyArrayObject *> (arr),
+                             owner) != 0) {
+    Py_DECREF (arr);
+    return NULL;
+  }
+  return arr;
+}
+%}
+
+%init %{
+  import_array ();
+%}
+
+%typemap(out) std::vector<int> {
+  $result = pev_counts_array (std::move ($1));
+  if ($result == NULL)
+    SWIG_fail;
+}
+
+/* a tuple of the stacked counts array and an int64 array of region
+   row offsets, one longer than the number of regions */
+%typemap(out) stacked_counts {
+  PyObject *counts = pev_counts_array (std::move ($1.counts));
+  if (counts == NULL)
+    SWIG_fail;
+  npy_intp n = static_cast<npy_intp> ($1.offsets.size ());
+  PyObject *offsets = PyArray_SimpleNew (1, &n, NPY_INT64);
+  if (offsets == NULL) {
+    Py_DECREF (counts);
+    SWIG_fail;
+  }
+  auto *off = static_cast<int64_t *> (
+      PyArray_DATA (reinterpret_cast<PyArrayObject *> (offsets)));
+  for (npy_intp i = 0; i < n; ++i)
+    off[i] = static_cast<int64_t> ($1.offsets[i]);
+  $result = PyTuple_Pack (2, counts, offsets);
+  Py_DECREF (counts);
+  Py_DECREF (offsets);
+  if ($result == NULL)
+    SWIG_fail;
+}
+
+/* counting that does not touch python objects runs without the GIL,
+   so other python threads proceed meanwhile. PileupReader keeps it, as
+   a reader must not be used from two threads at once */
+%define PEV_RELEASE_GIL(name)
+%exception name {
+  try {
+    PyThreadState *save = PyEval_SaveThread ();
+    try {
+      $action
+    } catch (...) {
+      PyEval_RestoreThread (save);
+      throw;
+    }
+    PyEval_RestoreThread (save);
+  } catch (const std::exception &e) {
+    SWIG_exception (SWIG_RuntimeError, e.what ());
+  }
+}
+%enddef
+
+PEV_RELEASE_GIL(count_events)
+PEV_RELEASE_GIL(count_events_samples)
+PEV_RELEASE_GIL(count_events_many)
+#endif
+
+#ifdef SWIGR
+/* R cannot adopt a foreign buffer as an integer vector, so in R the
+   counts are written straight into a freshly allocated integer matrix
+   instead. R matrices are column-major, so for the row-major counts to
+   need no reordering the matrix is transposed relative to python:
+   24 rows named by count_columns(), and a column per position. Use
+   t() for a position per row, at the cost of a copy */
+%{
+#include <algorithm>
+#include <climits>
+
+// allocates the result matrix, which stays protected until destroyed
+struct pev_r_counts {
+  SEXP mat = R_NilValue;
+
+  pev_r_counts () = default;
+  pev_r_counts (const pev_r_counts &) = delete;
+  pev_r_counts &operator= (const pev_r_counts &) = delete;
+
+  ~pev_r_counts () {
+    if (mat != R_NilValue)
+      UNPROTECT (1);
+  }
+
+  int *operator() (size_t n_cells) {
+    size_t n_cols = n_cells / N_FIELDS_PER_OBS;
+    if (n_cols > static_cast<size_t> (INT_MAX))
+      throw std::runtime_error ("result too large for an R matrix");
+    mat = PROTECT (Rf_allocMatrix (INTSXP, N_FIELDS_PER_OBS,
+                                   static_cast<int> (n_cols)));
+    std::fill (INTEGER (mat), INTEGER (mat) + n_cells, 0);
+
+    SEXP names = PROTECT (Rf_allocVector (STRSXP, N_FIELDS_PER_OBS));
+    auto cols = count_columns ();
+    for (size_t i = 0; i < cols.size (); ++i)
+      SET_STRING_ELT (names, i, Rf_mkChar (cols[i].c_str ()));
+    SEXP dimnames = PROTECT (Rf_allocVector (VECSXP, 2));
+    SET_VECTOR_ELT (dimnames, 0, names);
+    Rf_setAttrib (mat, R_DimNamesSymbol, dimnames);
+    UNPROTECT (2);
+    return INTEGER (mat);
+  }
+
+  cell_alloc alloc () {
+    return [this] (size_t n_cells) { return (*this) (n_cells); };
+  }
+};
+%}
+
+%ignore count_events;
+%ignore count_events_samples;
+%ignore count_events_many;
+%ignore stacked_counts;
+%ignore PileupReader::count;
+
+%rename(count_events) pev_r_count_events;
+%rename(count_events_samples) pev_r_count_events_samples;
+%rename(count_events_many) pev_r_count_events_many;
+%rename(count) PileupReader::count_matrix;
+
+%inline %{
+SEXP pev_r_count_events (std::string aln_path,
+                         std::string region_str,
+                         bool no_overlaps = false,
+                         int min_mapq = 25,
+                         int min_baseq = 30,
+                         int include_flag = 0,
+                         int exclude_flag = 3844,
+                         int max_depth = 1000000,
+                         int clip_bound = 0,
+                         int threads = 0,
+                         std::string reference = "",
+                         std::string ref_cache = "",
+                         std::string cache_dir = "") {
+  count_params cp{min_baseq, min_mapq,     clip_bound,
+                  max_depth, include_flag, exclude_flag};
+  PileupReader reader (aln_path, threads, reference, ref_cache,
+                       cache_dir);
+  pev_r_counts out;
+  reader.count_into (region_str, cp, AEVSettings{no_overlaps},
+                     out.alloc ());
+  return out.mat;
+}
+
+SEXP pev_r_count_events_samples (std::vector<std::string> aln_paths,
+                                 std::vector<std::string> region_strs,
+                                 bool no_overlaps = false,
+                                 int min_mapq = 25,
+                                 int min_baseq = 30,
+                                 int include_flag = 0,
+                                 int exclude_flag = 3844,
+                                 int max_depth = 1000000,
+                                 int clip_bound = 0,
+                                 int threads = 1,
+                                 std::string reference = "",
+                                 std::string ref_cache = "") {
+  count_params cp{min_baseq, min_mapq,     clip_bound,
+                  max_depth, include_flag, exclude_flag};
+  use_ref_cache (ref_cache);
+  pev_r_counts out;
+  count_samples (aln_paths, region_strs, cp, AEVSettings{no_overlaps},
+                 static_cast<size_t> (std::max (1, threads)),
+                 aln_opts{reference, nullptr}, out.alloc ());
+  return out.mat;
+}
+
+// list (counts = matrix, offsets = numeric) where region i is columns
+// offsets[i] + 1 to offsets[i + 1] of counts
+SEXP pev_r_count_events_many (std::string aln_path,
+                              std::vector<std::string> region_strs,
+                              int threads = 1,
+                              bool no_overlaps = false,
+                              int min_mapq = 25,
+                              int min_baseq = 30,
+                              int include_flag = 0,
+                              int exclude_flag = 3844,
+                              int max_depth = 1000000,
+                              int clip_bound = 0,
+                              std::string reference = "",
+                              std::string ref_cache = "") {
+  count_params cp{min_baseq, min_mapq,     clip_bound,
+                  max_depth, include_flag, exclude_flag};
+  use_ref_cache (ref_cache);
+  pev_r_counts out;
+  auto res = count_samples ({aln_path}, region_strs, cp,
+                            AEVSettings{no_overlaps},
+                            static_cast<size_t> (std::max (1, threads)),
+                            aln_opts{reference, nullptr}, out.alloc ());
+
+  SEXP offsets = PROTECT (Rf_allocVector (
+      REALSXP, static_cast<R_xlen_t> (res.region_offsets.size ())));
+  for (size_t i = 0; i < res.region_offsets.size (); ++i)
+    REAL (offsets)[i] = static_cast<double> (res.region_offsets[i]);
+  SEXP list = PROTECT (Rf_allocVector (VECSXP, 2));
+  SET_VECTOR_ELT (list, 0, out.mat);
+  SET_VECTOR_ELT (list, 1, offsets);
+  SEXP names = PROTECT (Rf_allocVector (STRSXP, 2));
+  SET_STRING_ELT (names, 0, Rf_mkChar ("counts"));
+  SET_STRING_ELT (names, 1, Rf_mkChar ("offsets"));
+  Rf_setAttrib (list, R_NamesSymbol, names);
+  UNPROTECT (3);
+  return list;
+}
+%}
+
+%extend PileupReader {
+  SEXP count_matrix (std::string region_str,
+                     bool no_overlaps = false,
+                     int min_mapq = 25,
+                     int min_baseq = 30,
+                     int include_flag = 0,
+                     int exclude_flag = 3844,
+                     int max_depth = 1000000,
+                     int clip_bound = 0) {
+    count_params cp{min_baseq, min_mapq,     clip_bound,
+                    max_depth, include_flag, exclude_flag};
+    pev_r_counts out;
+    $self->count_into (region_str, cp, AEVSettings{no_overlaps},
+                       out.alloc ());
+    return out.mat;
+  }
+}
+#endif
+
 /* wrap pileup-events */
 %include "bind.hpp"
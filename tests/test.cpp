@@ -1,7 +1,199 @@
+#include <algorithm>
+#include <atomic>
 #include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <string>
+#include <thread>
 
+#include "bind.hpp"
+#include "bounds.hpp"
+#include "cache.hpp"
 #include "const.hpp"
+#include "count.hpp"
+#include "downsample.hpp"
+#include "multi.hpp"
+#include "output.hpp"
+#include "parallel.hpp"
 #include "pileup.hpp"
+#include "planner.hpp"
+#include "point.hpp"
+#include "regions.hpp"
+#include "sites.hpp"
+#include "stats.hpp"
+#include "synth.hpp"
+
+// the reads of synth_bam() and synth_cram()
+static synth_params synth_test_params () {
+    synth_params sp;
+    sp.contig_len = 70000;
+    sp.depth = 40;
+    sp.read_len = 100;
+    sp.indel_rate = 0.005;
+    return sp;
+}
+
+// a small indexed synthetic BAM (see bench/synth.hpp), written once
+// for the tests that count real files. Its contig is longer than one
+// streaming window (STREAM_WINDOW_ROWS)
+static const std::string &synth_bam () {
+    static const std::string path = [] {
+        auto dir = std::filesystem::temp_directory_path();
+        std::string aln = (dir / "pev_test_synth.bam").string();
+        write_synthetic (aln, (dir / "pev_test_synth.fa").string(),
+                         synth_test_params());
+        return aln;
+    }();
+    return path;
+}
+
+// the reads of synth_bam() as CRAM, with its own copy of the same
+// reference
+static const std::string &synth_cram () {
+    static const std::string path = [] {
+        auto dir = std::filesystem::temp_directory_path();
+        std::string aln = (dir / "pev_test_synth.cram").string();
+        write_synthetic (aln, (dir / "pev_test_synth_cram.fa").string(),
+                         synth_test_params());
+        return aln;
+    }();
+    return path;
+}
+
+// a shallow synthetic BAM over several contigs, with stretches no
+// read covers
+static const std::string &gappy_bam () {
+    static const std::string path = [] {
+        auto dir = std::filesystem::temp_directory_path();
+        std::string aln = (dir / "pev_test_gappy.bam").string();
+        synth_params sp;
+        sp.contig_len = 30000;
+        sp.n_contigs = 3;
+        sp.depth = 2;
+        sp.read_len = 100;
+        sp.indel_rate = 0.005;
+        sp.error_rate = 0.02;
+        write_synthetic (aln, (dir / "pev_test_gappy.fa").string(), sp);
+        return aln;
+    }();
+    return path;
+}
+
+// a read of test_bam: all A, of the length its CIGAR implies
+struct test_read {
+    std::string qname;
+    uint16_t flag;
+    int64_t pos;
+    std::vector<uint32_t> cigar;
+};
+
+// write reads, position sorted, as an indexed BAM over one 1000 bp
+// contig "chr"
+static std::string test_bam (const std::string &name,
+                             const std::vector<test_read> &reads) {
+    std::string path =
+        (std::filesystem::temp_directory_path() / name).string();
+    htsFile *fh = hts_open (path.c_str(), "wb");
+    REQUIRE (fh != NULL);
+    const std::string text =
+        "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:chr\tLN:1000\n";
+    sam_hdr_t *head = sam_hdr_parse (text.size(), text.c_str());
+    REQUIRE (head != NULL);
+    REQUIRE (sam_hdr_write (fh, head) == 0);
+    bam1_t *b = bam_init1();
+    for (const test_read &r : reads) {
+        size_t len = static_cast<size_t> (bam_cigar2qlen (
+            static_cast<int> (r.cigar.size()), r.cigar.data()));
+        std::string seq (len, 'A'), qual (len, 30);
+        REQUIRE (bam_set1 (b, r.qname.size(), r.qname.c_str(), r.flag, 0,
+                           r.pos, 60, r.cigar.size(), r.cigar.data(), 0,
+                           r.pos, 0, len, seq.c_str(), qual.c_str(),
+                           0) >= 0);
+        REQUIRE (sam_write1 (fh, head, b) >= 0);
+    }
+    bam_destroy1 (b);
+    sam_hdr_destroy (head);
+    REQUIRE (hts_close (fh) == 0);
+    REQUIRE (sam_index_build (path.c_str(), 0) == 0);
+    return path;
+}
+
+// the parameters the tests count with unless testing one of them
+static count_params default_params () {
+    return count_params{30, 25, 0, 1000000, 0, 3844};
+}
+
+// an alignment file opened with its header and index, all closed
+// when it goes out of scope
+struct indexed_aln {
+    htsFile *fh = nullptr;
+    sam_hdr_t *head = nullptr;
+    hts_idx_t *idx = nullptr;
+
+    explicit indexed_aln (const std::string &path) {
+        fh = hts_open (path.c_str(), "r");
+        REQUIRE (fh != NULL);
+        head = sam_hdr_read (fh);
+        REQUIRE (head != NULL);
+        idx = sam_index_load (fh, path.c_str());
+        REQUIRE (idx != NULL);
+    }
+
+    indexed_aln (const indexed_aln &) = delete;
+    indexed_aln &operator= (const indexed_aln &) = delete;
+
+    ~indexed_aln () {
+        if (idx)
+            hts_idx_destroy (idx);
+        if (head)
+            sam_hdr_destroy (head);
+        if (fh)
+            hts_close (fh);
+    }
+};
+
+// stream reg through count_streaming, requiring it to hand over the
+// rows of count() that pass filter, each once and in order
+static void require_streamed_as_counted (htsFile *fh,
+                                         hts_idx_t *idx,
+                                         const hts_region &reg,
+                                         const count_params &cp,
+                                         const AEVSettings &settings,
+                                         RowFilter filter,
+                                         size_t window_rows) {
+    std::vector<int> expected (reg.rlen * N_FIELDS_PER_OBS, 0);
+    count (fh, idx, AlleleEventCounter (cp, expected, settings), reg,
+           cp);
+    std::vector<size_t> want_rows;
+    std::vector<int> want;
+    for (size_t r = 0; r < reg.rlen; ++r) {
+        const int *row = expected.data() + r * N_FIELDS_PER_OBS;
+        if (row_kept (filter, row)) {
+            want_rows.push_back (r);
+            want.insert (want.end(), row, row + N_FIELDS_PER_OBS);
+        }
+    }
+
+    std::vector<size_t> got_rows;
+    std::vector<int> got;
+    count_streaming (
+        fh, idx, reg, cp, settings,
+        [&] (size_t first_row, const int *rows, size_t n_rows) {
+            for (size_t r = 0; r < n_rows; ++r)
+                got_rows.push_back (first_row + r);
+            got.insert (got.end(), rows,
+                        rows + n_rows * N_FIELDS_PER_OBS);
+        },
+        filter, window_rows);
+    CAPTURE (reg.start, reg.rlen, settings.discard_overlaps,
+             static_cast<int> (filter), window_rows);
+    REQUIRE (got_rows == want_rows);
+    REQUIRE (got == want);
+}
 
 TEST_CASE ("score single") {
     std::vector<int> res (N_FIELDS_PER_OBS * 2,
@@ -65,3 +257,1483 @@ TEST_CASE ("score single") {
         REQUIRE (sum == 128); // rest unchanged
     }
 }
+
+TEST_CASE ("region lines") {
+    const std::string text = "@SQ\tSN:chr1\tLN:1000\n"
+                             "@SQ\tSN:chr2\tLN:500\n";
+    sam_hdr_t *head = sam_hdr_parse (text.size(), text.c_str());
+    REQUIRE (head != nullptr);
+
+    {
+        auto nr = parse_region_line (head, "chr1:100-200");
+        REQUIRE (nr.name == "chr1:100-200");
+        REQUIRE (nr.reg.rid == 0);
+        REQUIRE (nr.reg.start == 99);
+        REQUIRE (nr.reg.end == 200);
+        REQUIRE (nr.reg.rlen == 101);
+    }
+
+    {
+        auto nr = parse_region_line (head, "chr2\t99\t200\tsite_a");
+        REQUIRE (nr.name == "chr2:100-200"); // same as string form
+        REQUIRE (nr.reg.rid == 1);
+        REQUIRE (nr.reg.start == 99);
+        REQUIRE (nr.reg.rlen == 101);
+    }
+
+    {
+        auto nr = parse_region_line (head, "chr2:400-");
+        REQUIRE (nr.reg.end == 500); // clamped to contig
+    }
+
+    REQUIRE_THROWS (parse_region_line (head, "chr3\t1\t2"));
+    REQUIRE_THROWS (parse_region_line (head, "chr1\t1"));
+
+    sam_hdr_destroy (head);
+}
+
+TEST_CASE ("shard region") {
+    auto reg = hts_region::by_end (0, 100, 110);
+
+    auto shards = shard_region (reg, 3);
+    REQUIRE (shards.size() == 3);
+    REQUIRE (shards[0].start == 100);
+    REQUIRE (shards[0].rlen == 4);
+    REQUIRE (shards[1].start == 104);
+    REQUIRE (shards[1].rlen == 3);
+    REQUIRE (shards[2].start == 107);
+    REQUIRE (shards[2].end == 110);
+
+    // never more shards than positions
+    REQUIRE (shard_region (reg, 50).size() == 10);
+    REQUIRE (shard_region (reg, 0).size() == 1);
+}
+
+TEST_CASE ("read meta cache") {
+    bam1_t *b = bam_init1();
+    const uint32_t cigar[] = {4 << BAM_CIGAR_SHIFT | BAM_CMATCH};
+    REQUIRE (bam_set1 (b, 2, "r1", BAM_FREVERSE, 0, 10, 40, 1, cigar,
+                       -1, -1, 0, 4, "ACGT", NULL, 0) >= 0);
+
+    ReadMetaCache cache;
+    ReadMeta *m = cache.acquire (b);
+    REQUIRE (m->qlen == 4);
+    REQUIRE (m->map_q == 40);
+    REQUIRE (m->rev);
+
+    // released slots are recycled rather than reallocated
+    cache.release (b, m);
+    REQUIRE (cache.acquire (b) == m);
+    REQUIRE (cache.acquire (b) != m);
+
+    bam_destroy1 (b);
+}
+
+TEST_CASE ("discard overlaps") {
+    const uint32_t cigar[] = {1 << BAM_CIGAR_SHIFT | BAM_CMATCH};
+    auto make_read = [&] (const char *qname, uint16_t flag,
+                          const char *seq) {
+        bam1_t *b = bam_init1();
+        bam_set1 (b, strlen (qname), qname, flag, 0, 10, 40, 1, cigar,
+                  0, 10, 0, 1, seq, NULL, 0);
+        return b;
+    };
+    std::vector<bam1_t *> reads{
+        make_read ("pair", BAM_FPAIRED, "A"),
+        make_read ("solo", 0, "C"),
+        make_read ("pair", BAM_FPAIRED | BAM_FREVERSE, "A"),
+    };
+
+    ReadMetaCache cache (true);
+    std::vector<bam_pileup1_t> column (reads.size());
+    for (size_t i = 0; i < reads.size(); ++i) {
+        column[i] = bam_pileup1_t{};
+        column[i].b = reads[i];
+        column[i].is_head = 1;
+        column[i].is_tail = 1;
+        column[i].cd.p = cache.acquire (reads[i]);
+    }
+
+    std::vector<int> res (N_FIELDS_PER_OBS, 0);
+    count_params cp = default_params();
+    AlleleEventCounter aev (cp, res, AEVSettings{true});
+    aev.count_pileup (column.data(), 0, column.size());
+    CAPTURE (res);
+    // agreeing mates count once, toggling to the second seen first
+    REQUIRE (res[FIELD_NOBS] == 1);
+    REQUIRE (res[FIELD_C] == 1);
+    REQUIRE (res[FIELD_NOBS + RSTRAND_OFFSET] == 1);
+    REQUIRE (res[FIELD_A + RSTRAND_OFFSET] == 1);
+
+    // once a mate has left the pileup the other counts alone
+    cache.release (reads[2], static_cast<ReadMeta *> (column[2].cd.p));
+    aev.count_pileup (column.data(), 0, 2);
+    REQUIRE (res[FIELD_A] == 1);
+    REQUIRE (res[FIELD_NOBS] == 3);
+
+    for (size_t i = 0; i < reads.size(); ++i) {
+        if (i != 2)
+            cache.release (reads[i],
+                           static_cast<ReadMeta *> (column[i].cd.p));
+        bam_destroy1 (reads[i]);
+    }
+
+    // a third read sharing a name counts alone: mates are paired in
+    // the order they enter the pileup, and a name already paired
+    // starts over. Agreeing pairs toggle across the column
+    std::vector<bam1_t *> dups{
+        make_read ("dup", BAM_FPAIRED, "A"),
+        make_read ("dup", BAM_FPAIRED | BAM_FREVERSE, "A"),
+        make_read ("dup", BAM_FPAIRED, "G"),
+        make_read ("p2", BAM_FPAIRED, "C"),
+        make_read ("p2", BAM_FPAIRED | BAM_FREVERSE, "C"),
+    };
+    ReadMetaCache dup_cache (true);
+    std::vector<bam_pileup1_t> dup_column (dups.size());
+    for (size_t i = 0; i < dups.size(); ++i) {
+        dup_column[i] = bam_pileup1_t{};
+        dup_column[i].b = dups[i];
+        dup_column[i].is_head = 1;
+        dup_column[i].is_tail = 1;
+        dup_column[i].cd.p = dup_cache.acquire (dups[i]);
+    }
+    std::vector<int> dup_res (N_FIELDS_PER_OBS, 0);
+    AlleleEventCounter dup_aev (cp, dup_res, AEVSettings{true});
+    dup_aev.count_pileup (dup_column.data(), 0, dup_column.size());
+    CAPTURE (dup_res);
+    // the first pair credits its second read, the second pair its
+    // first; the third "dup" read is counted as it is
+    REQUIRE (dup_res[FIELD_NOBS] == 2);
+    REQUIRE (dup_res[FIELD_G] == 1);
+    REQUIRE (dup_res[FIELD_C] == 1);
+    REQUIRE (dup_res[FIELD_NOBS + RSTRAND_OFFSET] == 1);
+    REQUIRE (dup_res[FIELD_A + RSTRAND_OFFSET] == 1);
+    for (size_t i = 0; i < dups.size(); ++i) {
+        dup_cache.release (dups[i],
+                           static_cast<ReadMeta *> (dup_column[i].cd.p));
+        bam_destroy1 (dups[i]);
+    }
+}
+
+TEST_CASE ("row writer") {
+    auto path = (std::filesystem::temp_directory_path() /
+                 "pev_test_row_writer.csv")
+                    .string();
+    std::vector<int> row (N_FIELDS_PER_OBS, 0);
+    row[FIELD_A] = 12;
+    row[FIELD_MAPQ] = -3;
+    row[N_FIELDS_PER_OBS - 1] = 1000000;
+    {
+        RowWriter w (path);
+        w.cell ("pos");
+        w.header();
+        w.cell (uint64_t{100});
+        w.counts (row.data());
+        w.close();
+    }
+
+    std::string expected = "pos," + std::string (HEADER) + "\n100,";
+    for (size_t j = 0; j < N_FIELDS_PER_OBS; ++j) {
+        expected += std::to_string (row[j]);
+        expected += j + 1 < N_FIELDS_PER_OBS ? "," : "\n";
+    }
+    std::ifstream in (path, std::ios::binary);
+    std::string got ((std::istreambuf_iterator<char> (in)),
+                     std::istreambuf_iterator<char>());
+    REQUIRE (got == expected);
+    std::filesystem::remove (path);
+}
+
+TEST_CASE ("matrix writer") {
+    auto path = (std::filesystem::temp_directory_path() /
+                 "pev_test_matrix.bin")
+                    .string();
+    std::vector<int> row (N_FIELDS_PER_OBS, 0);
+    row[FIELD_T] = 7;
+    count_params cp = default_params();
+    std::string json = matrix_header_json (
+        {"pos"}, {{"chr1:100-101", "chr1", 100, 101}}, cp,
+        AEVSettings{});
+    REQUIRE (json.find ("\"n_cols\":25") != std::string::npos);
+    REQUIRE (json.find ("\"n_rows\":2") != std::string::npos);
+    {
+        MatrixWriter w (path, json);
+        for (uint64_t pos : {100, 101}) {
+            w.cell (pos);
+            w.counts (row.data());
+        }
+        w.close();
+    }
+
+    std::ifstream in (path, std::ios::binary);
+    std::string got ((std::istreambuf_iterator<char> (in)),
+                     std::istreambuf_iterator<char>());
+    REQUIRE (got.compare (0, 8, MATRIX_MAGIC, 8) == 0);
+    uint32_t hlen;
+    std::memcpy (&hlen, got.data() + 8, sizeof hlen);
+    size_t data_offset = 12 + hlen;
+    REQUIRE (data_offset % MATRIX_ALIGN == 0);
+    REQUIRE (got.size() - data_offset ==
+             2 * (N_FIELDS_PER_OBS + 1) * sizeof (uint32_t));
+
+    std::vector<uint32_t> cells ((got.size() - data_offset) /
+                                 sizeof (uint32_t));
+    std::memcpy (cells.data(), got.data() + data_offset,
+                 got.size() - data_offset);
+    REQUIRE (cells[0] == 100);
+    REQUIRE (cells[1 + FIELD_T] == 7);
+    REQUIRE (cells[N_FIELDS_PER_OBS + 1] == 101);
+
+    // positions past uint32 are refused rather than wrapped
+    REQUIRE (json.find ("\"max_value\":4294967295") != std::string::npos);
+    {
+        MatrixWriter w (path, json);
+        w.cell (MATRIX_CELL_MAX);
+        REQUIRE_THROWS_AS (w.cell (MATRIX_CELL_MAX + 1),
+                           std::runtime_error);
+    }
+    std::filesystem::remove (path);
+}
+
+TEST_CASE ("sparse row filter") {
+    // three positions: uncovered, pure A, A with a minor reverse C
+    std::vector<int> rows (3 * N_FIELDS_PER_OBS, 0);
+    int *pure = rows.data() + N_FIELDS_PER_OBS;
+    pure[FIELD_A] = pure[FIELD_NOBS] = 5;
+    int *minor = rows.data() + 2 * N_FIELDS_PER_OBS;
+    minor[FIELD_A] = minor[FIELD_NOBS] = 5;
+    minor[RSTRAND_OFFSET + FIELD_C] = 1;
+    minor[RSTRAND_OFFSET + FIELD_NOBS] = 1;
+
+    REQUIRE (row_kept (RowFilter::all, rows.data()));
+    REQUIRE_FALSE (row_kept (RowFilter::covered, rows.data()));
+    REQUIRE (row_kept (RowFilter::covered, pure));
+    REQUIRE_FALSE (row_kept (RowFilter::variant, pure));
+    REQUIRE (row_kept (RowFilter::variant, minor));
+
+    std::vector<std::pair<size_t, size_t>> runs;
+    row_sink collect = [&] (size_t first_row, const int *,
+                            size_t n_rows) {
+        runs.emplace_back (first_row, n_rows);
+    };
+    sink_filtered (RowFilter::covered, collect, 10, rows.data(), 3);
+    REQUIRE (runs == std::vector<std::pair<size_t, size_t>>{{11, 2}});
+    runs.clear();
+    sink_filtered (RowFilter::variant, collect, 10, rows.data(), 3);
+    REQUIRE (runs == std::vector<std::pair<size_t, size_t>>{{12, 1}});
+}
+
+TEST_CASE ("streamed counts equal whole region counts") {
+    indexed_aln aln (synth_bam());
+    count_params cp = default_params();
+    // the whole contig, over a window boundary
+    hts_region contig = hts_region::by_end (0, 0, 70000);
+    REQUIRE (contig.rlen > STREAM_WINDOW_ROWS);
+
+    for (bool overlaps : {false, true}) {
+        for (RowFilter filter : {RowFilter::all, RowFilter::covered,
+                                 RowFilter::variant}) {
+            for (size_t window : {STREAM_WINDOW_ROWS, size_t{1000}}) {
+                require_streamed_as_counted (aln.fh, aln.idx, contig, cp,
+                                             AEVSettings{overlaps},
+                                             filter, window);
+            }
+            // short regions, counted without a pileup as no hook is
+            // set, and one just past that
+            for (size_t rlen : {size_t{1}, POINT_QUERY_MAX_LEN,
+                                POINT_QUERY_MAX_LEN + 1}) {
+                require_streamed_as_counted (
+                    aln.fh, aln.idx, hts_region::by_len (0, 33333, rlen),
+                    cp, AEVSettings{overlaps}, filter,
+                    STREAM_WINDOW_ROWS);
+            }
+        }
+    }
+}
+
+TEST_CASE ("sparse streaming over coverage gaps") {
+    indexed_aln aln (gappy_bam());
+    count_params cp = default_params();
+    hts_region contig = hts_region::by_end (0, 0, 30000);
+    const size_t window = 32;
+
+    std::vector<int> expected (contig.rlen * N_FIELDS_PER_OBS, 0);
+    count (aln.fh, aln.idx,
+           AlleleEventCounter (cp, expected, AEVSettings{}), contig, cp);
+    // whole windows no read covers, and rows beyond the majority
+    size_t gap = 0, longest_gap = 0, n_variant = 0;
+    for (size_t r = 0; r < contig.rlen; ++r) {
+        const int *row = expected.data() + r * N_FIELDS_PER_OBS;
+        gap = row_kept (RowFilter::covered, row) ? 0 : gap + 1;
+        longest_gap = std::max (longest_gap, gap);
+        n_variant += row_kept (RowFilter::variant, row);
+    }
+    REQUIRE (longest_gap > 2 * window);
+    REQUIRE (n_variant > 0);
+
+    for (bool overlaps : {false, true}) {
+        for (RowFilter filter : {RowFilter::covered, RowFilter::variant}) {
+            for (size_t w : {window, STREAM_WINDOW_ROWS}) {
+                require_streamed_as_counted (aln.fh, aln.idx, contig, cp,
+                                             AEVSettings{overlaps},
+                                             filter, w);
+            }
+        }
+    }
+
+    // sparse rows in a binary matrix: no row offsets, each row found
+    // by its pos column
+    auto path = (std::filesystem::temp_directory_path() /
+                 "pev_test_sparse.bin")
+                    .string();
+    std::string json = matrix_header_json (
+        {"pos"}, {{"synth:1-30000", "synth", 1, 30000}}, cp,
+        AEVSettings{}, false);
+    REQUIRE (json.find ("\"dense\":false") != std::string::npos);
+    REQUIRE (json.find ("row_offset") == std::string::npos);
+    size_t n_written = 0;
+    {
+        MatrixWriter w (path, json);
+        count_streaming (
+            aln.fh, aln.idx, contig, cp, AEVSettings{},
+            [&] (size_t first_row, const int *rows, size_t n_rows) {
+                REQUIRE (n_rows > 0);
+                for (size_t r = 0; r < n_rows; ++r) {
+                    w.cell (static_cast<uint64_t> (contig.start) +
+                            first_row + r + 1);
+                    w.counts (rows + r * N_FIELDS_PER_OBS);
+                    ++n_written;
+                }
+            },
+            RowFilter::covered, window);
+        w.close();
+    }
+    REQUIRE (n_written < contig.rlen);
+
+    std::ifstream in (path, std::ios::binary);
+    std::string got ((std::istreambuf_iterator<char> (in)),
+                     std::istreambuf_iterator<char>());
+    uint32_t hlen;
+    std::memcpy (&hlen, got.data() + 8, sizeof hlen);
+    REQUIRE (got.compare (12, json.size(), json) == 0);
+    size_t data_offset = 12 + hlen;
+    size_t n_cols = N_FIELDS_PER_OBS + 1;
+    REQUIRE (got.size() - data_offset ==
+             n_written * n_cols * sizeof (uint32_t));
+    std::vector<uint32_t> cells ((got.size() - data_offset) /
+                                 sizeof (uint32_t));
+    std::memcpy (cells.data(), got.data() + data_offset,
+                 got.size() - data_offset);
+    size_t r = 0;
+    for (size_t p = 0; p < contig.rlen; ++p) {
+        const int *row = expected.data() + p * N_FIELDS_PER_OBS;
+        if (!row_kept (RowFilter::covered, row))
+            continue;
+        REQUIRE (r < n_written);
+        const uint32_t *mrow = cells.data() + r++ * n_cols;
+        REQUIRE (mrow[0] == p + 1);
+        for (size_t f = 0; f < N_FIELDS_PER_OBS; ++f)
+            REQUIRE (mrow[1 + f] == static_cast<uint32_t> (row[f]));
+    }
+    REQUIRE (r == n_written);
+    std::filesystem::remove (path);
+}
+
+TEST_CASE ("streamed whole file equals counts per contig") {
+    indexed_aln aln (gappy_bam());
+    count_params cp = default_params();
+    int n_contigs = sam_hdr_nref (aln.head);
+    REQUIRE (n_contigs == 3);
+
+    for (bool overlaps : {false, true}) {
+        AEVSettings settings{overlaps};
+        // each contig counted over chr:1- through its index
+        std::vector<hts_region> regs;
+        std::vector<std::vector<int>> expected;
+        for (int tid = 0; tid < n_contigs; ++tid) {
+            regs.push_back (
+                parse_region (aln.head, synth_contig (tid) + ":1-"));
+            expected.emplace_back (regs.back().rlen * N_FIELDS_PER_OBS,
+                                   0);
+            count (aln.fh, aln.idx,
+                   AlleleEventCounter (cp, expected.back(), settings),
+                   regs.back(), cp);
+        }
+
+        for (RowFilter filter : {RowFilter::all, RowFilter::covered,
+                                 RowFilter::variant}) {
+            // blocks that span contigs, and blocks much smaller than
+            // a contig
+            for (size_t block_rows : {STREAM_WINDOW_ROWS, size_t{7}}) {
+                CAPTURE (overlaps, static_cast<int> (filter),
+                         block_rows);
+                htsFile *sfh = hts_open (gappy_bam().c_str(), "r");
+                REQUIRE (sfh != NULL);
+                sam_hdr_t *shead = sam_hdr_read (sfh);
+                REQUIRE (shead != NULL);
+                std::vector<std::vector<char>> seen (n_contigs);
+                for (int tid = 0; tid < n_contigs; ++tid)
+                    seen[tid].assign (regs[tid].rlen, 0);
+                int32_t last_tid = -1;
+                int64_t last_pos = -1;
+                std::set<int32_t> tids_seen;
+                count_file_streaming (
+                    sfh, shead, cp, settings,
+                    [&] (const int32_t *tids, const int64_t *pos,
+                         const int *rows, size_t n_rows) {
+                        REQUIRE (n_rows > 0);
+                        REQUIRE (n_rows <= block_rows);
+                        for (size_t r = 0; r < n_rows; ++r) {
+                            // in file order, each position once
+                            REQUIRE (tids[r] >= last_tid);
+                            if (tids[r] == last_tid)
+                                REQUIRE (pos[r] > last_pos);
+                            last_tid = tids[r];
+                            last_pos = pos[r];
+                            tids_seen.insert (tids[r]);
+                            REQUIRE (tids[r] < n_contigs);
+                            REQUIRE (pos[r] >= 0);
+                            REQUIRE (pos[r] < regs[tids[r]].end);
+                            const int *want =
+                                expected[tids[r]].data() +
+                                pos[r] * N_FIELDS_PER_OBS;
+                            const int *got = rows + r * N_FIELDS_PER_OBS;
+                            REQUIRE (std::equal (got,
+                                                 got + N_FIELDS_PER_OBS,
+                                                 want));
+                            seen[tids[r]][pos[r]] = 1;
+                        }
+                    },
+                    filter, block_rows);
+                sam_hdr_destroy (shead);
+                hts_close (sfh);
+                REQUIRE (tids_seen.size() ==
+                         static_cast<size_t> (n_contigs));
+
+                // nothing the filter keeps is missed; the filtered
+                // streams hand over exactly what it keeps
+                size_t n_gaps = 0;
+                for (int tid = 0; tid < n_contigs; ++tid) {
+                    for (size_t p = 0; p < regs[tid].rlen; ++p) {
+                        const int *row = expected[tid].data() +
+                            p * N_FIELDS_PER_OBS;
+                        bool kept = row_kept (filter, row) &&
+                            row_kept (RowFilter::covered, row);
+                        if (kept || filter != RowFilter::all)
+                            REQUIRE (static_cast<bool> (seen[tid][p]) ==
+                                     kept);
+                        n_gaps += !row_kept (RowFilter::covered, row);
+                    }
+                }
+                REQUIRE (n_gaps > 0);
+            }
+        }
+    }
+}
+
+TEST_CASE ("stacked samples equal single sample counts") {
+    std::vector<std::string> samples{synth_bam(), gappy_bam(),
+                                     synth_bam()};
+    std::vector<std::string> region_strs{"synth:1000-2000",
+                                         "synth\t20000\t25000",
+                                         "synth:29990-29990"};
+    count_params cp = default_params();
+
+    for (bool overlaps : {false, true}) {
+        AEVSettings settings{overlaps};
+        // each (sample, region) counted on its own
+        std::vector<std::vector<int>> expected;
+        for (const std::string &path : samples) {
+            indexed_aln aln (path);
+            for (const std::string &line : region_strs) {
+                hts_region reg = parse_region_line (aln.head, line).reg;
+                expected.emplace_back (reg.rlen * N_FIELDS_PER_OBS, 0);
+                count (aln.fh, aln.idx,
+                       AlleleEventCounter (cp, expected.back(),
+                                           settings),
+                       reg, cp);
+            }
+        }
+
+        for (size_t n_workers : {size_t{1}, size_t{3}}) {
+            CAPTURE (overlaps, n_workers);
+            multi_sample_counts res = count_samples (
+                samples, region_strs, cp, settings, n_workers);
+            REQUIRE (res.region_offsets.size() == region_strs.size() + 1);
+            for (size_t si = 0; si < samples.size(); ++si) {
+                for (size_t ri = 0; ri < region_strs.size(); ++ri) {
+                    const int *rows = res.sample_rows (si) +
+                        res.region_offsets[ri] * N_FIELDS_PER_OBS;
+                    const std::vector<int> &want =
+                        expected[si * region_strs.size() + ri];
+                    REQUIRE (std::equal (want.begin(), want.end(), rows));
+                }
+            }
+
+            // streamed unit by unit, in sample then region order
+            sample_set set = load_samples (samples, region_strs,
+                                           settings, n_workers);
+            size_t unit = 0;
+            stream_samples (set, cp, settings, n_workers, {},
+                            [&] (size_t si, size_t ri, const int *rows) {
+                                REQUIRE (si ==
+                                         unit / region_strs.size());
+                                REQUIRE (ri ==
+                                         unit % region_strs.size());
+                                const std::vector<int> &want =
+                                    expected[unit++];
+                                REQUIRE (std::equal (want.begin(),
+                                                     want.end(), rows));
+                            });
+            REQUIRE (unit == samples.size() * region_strs.size());
+        }
+    }
+}
+
+TEST_CASE ("pileup reader") {
+    auto dir = std::filesystem::temp_directory_path();
+    count_params cp = default_params();
+    std::vector<std::string> region_strs{"synth:1000-1999",
+                                         "synth:40000-40010",
+                                         "synth:69000-"};
+    // each region counted directly on the BAM
+    indexed_aln aln (synth_bam());
+    std::vector<hts_region> regs;
+    std::vector<std::vector<int>> expected[2];
+    for (const std::string &rs : region_strs) {
+        regs.push_back (parse_region (aln.head, rs));
+        for (bool overlaps : {false, true}) {
+            expected[overlaps].emplace_back (
+                regs.back().rlen * N_FIELDS_PER_OBS, 0);
+            count (aln.fh, aln.idx,
+                   AlleleEventCounter (cp, expected[overlaps].back(),
+                                       AEVSettings{overlaps}),
+                   regs.back(), cp);
+        }
+    }
+
+    // CRAM, with read names decoded only while pairing mates: the
+    // handle is reconfigured whenever that changes between calls
+    {
+        PileupReader reader (synth_cram(), 0,
+                             (dir / "pev_test_synth_cram.fa").string());
+        for (bool overlaps : {false, true, false, true}) {
+            for (size_t ri = 0; ri < region_strs.size(); ++ri) {
+                CAPTURE (overlaps, region_strs[ri]);
+                REQUIRE (reader.count (region_strs[ri], overlaps) ==
+                         expected[overlaps][ri]);
+            }
+        }
+        reader.close();
+        REQUIRE_FALSE (reader.is_open());
+        REQUIRE_THROWS (reader.count (region_strs[0]));
+    }
+
+    // with a cache, the second count of a region is read back, into
+    // the caller's buffer allocated once
+    auto cache_dir = dir / "pev_test_reader_cache";
+    std::filesystem::remove_all (cache_dir);
+    {
+        PileupReader reader (synth_bam(), 0, "", "", cache_dir.string());
+        for (int pass = 0; pass < 2; ++pass) {
+            for (bool overlaps : {false, true}) {
+                for (size_t ri = 0; ri < region_strs.size(); ++ri) {
+                    CAPTURE (pass, overlaps, region_strs[ri]);
+                    std::vector<int> cells;
+                    size_t n_allocs = 0, n_asked = 0;
+                    int *got = reader.count_into (
+                        region_strs[ri], cp, AEVSettings{overlaps},
+                        [&] (size_t n_cells) {
+                            ++n_allocs;
+                            n_asked = n_cells;
+                            cells.assign (n_cells, 0);
+                            return cells.data();
+                        });
+                    REQUIRE (n_allocs == 1);
+                    REQUIRE (n_asked == regs[ri].rlen * N_FIELDS_PER_OBS);
+                    REQUIRE (got == cells.data());
+                    REQUIRE (cells == expected[overlaps][ri]);
+                }
+            }
+        }
+    }
+    size_t n_entries = 0;
+    for (const auto &de : std::filesystem::directory_iterator (cache_dir)) {
+        REQUIRE (de.path().extension() == CACHE_SUFFIX);
+        ++n_entries;
+    }
+    REQUIRE (n_entries == 2 * region_strs.size());
+    std::filesystem::remove_all (cache_dir);
+
+    // the one-call and many-region entry points
+    REQUIRE (count_events (synth_bam(), region_strs[1]) ==
+             expected[0][1]);
+    REQUIRE (count_events (synth_bam(), region_strs[1], true) ==
+             expected[1][1]);
+    for (int threads : {1, 3}) {
+        for (bool overlaps : {false, true}) {
+            CAPTURE (threads, overlaps);
+            stacked_counts many = count_events_many (
+                synth_bam(), region_strs, threads, overlaps);
+            REQUIRE (many.offsets.size() == region_strs.size() + 1);
+            REQUIRE (many.offsets[0] == 0);
+            REQUIRE (many.counts.size() ==
+                     many.offsets.back() * N_FIELDS_PER_OBS);
+            for (size_t ri = 0; ri < region_strs.size(); ++ri) {
+                REQUIRE (many.offsets[ri + 1] - many.offsets[ri] ==
+                         regs[ri].rlen);
+                auto first = many.counts.begin() +
+                    static_cast<std::ptrdiff_t> (many.offsets[ri] *
+                                                 N_FIELDS_PER_OBS);
+                REQUIRE (std::equal (expected[overlaps][ri].begin(),
+                                     expected[overlaps][ri].end(),
+                                     first));
+            }
+        }
+    }
+}
+
+TEST_CASE ("parallel for") {
+    std::vector<int> seen (1000, 0);
+    std::vector<int> worker_of (1000, -1);
+    parallel_for (seen.size(), 4, [&] (size_t i, size_t worker) {
+        ++seen[i];
+        worker_of[i] = static_cast<int> (worker);
+    });
+    for (size_t i = 0; i < seen.size(); ++i) {
+        REQUIRE (seen[i] == 1);
+        REQUIRE (worker_of[i] >= 0);
+        REQUIRE (worker_of[i] < 4);
+    }
+
+    REQUIRE_THROWS_AS (parallel_for (10, 3,
+                                     [] (size_t i, size_t) {
+                                         if (i == 7)
+                                             throw std::runtime_error (
+                                                 "unit failed");
+                                     }),
+                       std::runtime_error);
+}
+
+TEST_CASE ("cluster sites") {
+    std::vector<site> sites{{0, 100, 101}, {0, 100, 101},
+                            {0, 600, 2000}, {0, 2500, 2510},
+                            {0, 5000, 5001}, {1, 10, 11}};
+    auto clusters = cluster_sites (sites, 1000);
+    REQUIRE (clusters.size() == 3);
+    REQUIRE (clusters[0].first == 0);
+    REQUIRE (clusters[0].last == 4);
+    REQUIRE (clusters[0].reg.start == 100);
+    REQUIRE (clusters[0].reg.end == 2510);
+    REQUIRE (clusters[1].reg.rlen == 1);
+    REQUIRE (clusters[2].reg.rid == 1);
+
+    // the gap is from the end of a site, not its start
+    REQUIRE (cluster_sites (sites, 500).size() == 4);
+
+    // one sweep per contig
+    REQUIRE (cluster_sites (sites, -1).size() == 2);
+}
+
+TEST_CASE ("site counts equal region counts") {
+    indexed_aln aln (synth_bam());
+    count_params cp = default_params();
+    auto dir = std::filesystem::temp_directory_path();
+
+    // overlapping and adjacent intervals merge, each position once
+    std::string bed = (dir / "pev_test_sites.bed").string();
+    {
+        std::ofstream out (bed);
+        out << "track name=sites\n"
+            << "synth\t100\t200\n"
+            << "synth\t150\t250\n"
+            << "synth\t250\t260\n"
+            << "synth\t3000\t3001\n"
+            << "synth\t69990\t70000\n";
+    }
+    std::vector<site> bed_sites = read_sites_file (aln.head, bed);
+    REQUIRE (bed_sites.size() == 3);
+    REQUIRE (bed_sites[0].start == 100);
+    REQUIRE (bed_sites[0].end == 260);
+    std::vector<int64_t> bed_pos;
+    for (int64_t p = 100; p < 260; ++p)
+        bed_pos.push_back (p);
+    bed_pos.push_back (3000);
+    for (int64_t p = 69990; p < 70000; ++p)
+        bed_pos.push_back (p);
+
+    // repeated VCF records each get a row
+    std::string vcf = (dir / "pev_test_sites.vcf").string();
+    {
+        std::ofstream out (vcf);
+        out << "##fileformat=VCFv4.2\n"
+            << "##contig=<ID=synth,length=70000>\n"
+            << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n"
+            << "synth\t101\t.\tA\tC\t.\t.\t.\n"
+            << "synth\t101\t.\tA\tG\t.\t.\t.\n"
+            << "synth\t102\t.\tA\tC\t.\t.\t.\n"
+            << "synth\t40000\t.\tA\tC\t.\t.\t.\n"
+            << "synth\t40000\t.\tA\tT\t.\t.\t.\n";
+    }
+    std::vector<site> vcf_sites = read_sites_file (aln.head, vcf);
+    REQUIRE (vcf_sites.size() == 5);
+    std::vector<int64_t> vcf_pos{100, 100, 101, 39999, 39999};
+
+    // sites built by hand may overlap, repeating the shared rows
+    std::vector<site> overlap_sites{{0, 10, 20}, {0, 15, 25},
+                                    {0, 15, 16}};
+    std::vector<int64_t> overlap_pos;
+    for (int64_t p = 10; p < 25; ++p) {
+        int copies = 1 + (p >= 15 && p < 20) + (p == 15);
+        for (int c = 0; c < copies; ++c)
+            overlap_pos.push_back (p);
+    }
+
+    for (bool overlaps : {false, true}) {
+        AEVSettings settings{overlaps};
+        hts_region contig = hts_region::by_end (0, 0, 70000);
+        std::vector<int> expected (contig.rlen * N_FIELDS_PER_OBS, 0);
+        count (aln.fh, aln.idx,
+               AlleleEventCounter (cp, expected, settings), contig, cp);
+
+        auto check = [&] (const std::vector<site> &sites,
+                          const std::vector<int64_t> &positions,
+                          RowFilter filter, int64_t max_gap,
+                          size_t block_rows) {
+            std::vector<int64_t> want_pos;
+            std::vector<int> want;
+            for (int64_t p : positions) {
+                const int *row = expected.data() + p * N_FIELDS_PER_OBS;
+                if (!row_kept (filter, row))
+                    continue;
+                want_pos.push_back (p);
+                want.insert (want.end(), row, row + N_FIELDS_PER_OBS);
+            }
+            std::vector<int64_t> got_pos;
+            std::vector<int> got;
+            count_sites (
+                aln.fh, aln.idx, sites, cp, settings,
+                [&] (const int32_t *tids, const int64_t *pos,
+                     const int *rows, size_t n_rows) {
+                    REQUIRE (n_rows <= block_rows);
+                    for (size_t r = 0; r < n_rows; ++r) {
+                        REQUIRE (tids[r] == 0);
+                        got_pos.push_back (pos[r]);
+                    }
+                    got.insert (got.end(), rows,
+                                rows + n_rows * N_FIELDS_PER_OBS);
+                },
+                filter, max_gap, block_rows);
+            CAPTURE (overlaps, static_cast<int> (filter), max_gap,
+                     block_rows);
+            REQUIRE (got_pos == want_pos);
+            REQUIRE (got == want);
+        };
+        for (RowFilter filter : {RowFilter::all, RowFilter::covered,
+                                 RowFilter::variant}) {
+            for (int64_t max_gap : {SITE_CLUSTER_GAP, int64_t{0},
+                                    int64_t{-1}}) {
+                for (size_t block_rows : {STREAM_WINDOW_ROWS,
+                                          size_t{3}}) {
+                    check (bed_sites, bed_pos, filter, max_gap,
+                           block_rows);
+                    check (vcf_sites, vcf_pos, filter, max_gap,
+                           block_rows);
+                    check (overlap_sites, overlap_pos, filter, max_gap,
+                           block_rows);
+                }
+            }
+        }
+    }
+    std::filesystem::remove (bed);
+    std::filesystem::remove (vcf);
+}
+
+TEST_CASE ("plan regions") {
+    std::vector<hts_region> regs{hts_region::by_end (0, 500, 600),
+                                 hts_region::by_end (0, 100, 200),
+                                 hts_region::by_end (1, 100, 200),
+                                 hts_region::by_end (0, 150, 300)};
+    auto plans = plan_regions (regs, 200);
+    REQUIRE (plans.size() == 2);
+    REQUIRE (plans[0].span.start == 100);
+    REQUIRE (plans[0].span.end == 600);
+    REQUIRE (plans[0].members == std::vector<size_t>{1, 3, 0});
+    REQUIRE (plans[1].members == std::vector<size_t>{2});
+
+    // only overlapping regions merge without a gap
+    REQUIRE (plan_regions (regs, 0).size() == 3);
+    REQUIRE (plan_regions (regs, -1).size() == 4);
+}
+
+TEST_CASE ("point query matches pileup") {
+    auto op = [] (uint32_t len, int o) {
+        return len << BAM_CIGAR_SHIFT | static_cast<uint32_t> (o);
+    };
+    // position sorted, covering clips, indels, skips and padding, and
+    // the runs htslib reports as one indel: 1D2D, 2I1P1I, and
+    // insertions after padding and a skip
+    const std::vector<std::pair<int64_t, std::vector<uint32_t>>> reads{
+        {10, {op (3, BAM_CMATCH), op (2, BAM_CINS), op (4, BAM_CMATCH)}},
+        {11, {op (2, BAM_CSOFT_CLIP), op (2, BAM_CMATCH),
+              op (3, BAM_CDEL), op (3, BAM_CEQUAL)}},
+        {12, {op (1, BAM_CMATCH), op (2, BAM_CREF_SKIP),
+              op (2, BAM_CDIFF), op (1, BAM_CSOFT_CLIP)}},
+        {13, {op (2, BAM_CMATCH), op (1, BAM_CPAD), op (2, BAM_CINS),
+              op (1, BAM_CPAD), op (1, BAM_CINS), op (2, BAM_CMATCH)}},
+        {14, {op (2, BAM_CDEL), op (3, BAM_CMATCH)}},
+        {14, {op (1, BAM_CMATCH), op (1, BAM_CDEL), op (2, BAM_CDEL),
+              op (1, BAM_CMATCH)}},
+        {14, {op (1, BAM_CMATCH), op (2, BAM_CINS), op (1, BAM_CPAD),
+              op (1, BAM_CINS), op (2, BAM_CMATCH)}},
+        {15, {op (1, BAM_CMATCH), op (1, BAM_CPAD), op (1, BAM_CREF_SKIP),
+              op (2, BAM_CINS), op (1, BAM_CMATCH)}},
+    };
+
+    bam_plp_t plp = bam_plp_init (NULL, NULL);
+    std::vector<bam1_t *> recs;
+    for (const auto &r : reads) {
+        std::string seq (static_cast<size_t> (bam_cigar2qlen (
+                             static_cast<int> (r.second.size()),
+                             r.second.data())),
+                         'A');
+        bam1_t *b = bam_init1();
+        REQUIRE (bam_set1 (b, 1, "r", 0, 0, r.first, 40, r.second.size(),
+                           r.second.data(), -1, -1, 0, seq.size(),
+                           seq.c_str(), NULL, 0) >= 0);
+        REQUIRE (cigar_walkable (b));
+        REQUIRE (bam_plp_push (plp, b) == 0);
+        recs.push_back (b);
+    }
+    REQUIRE (bam_plp_push (plp, NULL) == 0);
+
+    int tid, n_plp;
+    hts_pos_t pos;
+    const bam_pileup1_t *pl;
+    size_t n_columns = 0;
+    while ((pl = bam_plp64_next (plp, &tid, &pos, &n_plp)) != NULL) {
+        ++n_columns;
+        CAPTURE (pos);
+        // the walk finds the same reads, in the same order
+        int j = 0;
+        for (bam1_t *b : recs) {
+            bam_pileup1_t p{};
+            if (!resolve_at (b, pos, p))
+                continue;
+            REQUIRE (j < n_plp);
+            const bam_pileup1_t &e = pl[j++];
+            CAPTURE (e.b->core.pos);
+            REQUIRE (e.b->core.pos == b->core.pos);
+            REQUIRE (p.qpos == e.qpos);
+            REQUIRE (p.indel == e.indel);
+            REQUIRE (p.is_del == e.is_del);
+            REQUIRE (p.is_refskip == e.is_refskip);
+            REQUIRE (p.is_head == e.is_head);
+            REQUIRE (p.is_tail == e.is_tail);
+            REQUIRE (p.cigar_ind == e.cigar_ind);
+        }
+        REQUIRE (j == n_plp);
+    }
+    REQUIRE (n_columns == 9); // 10 to 18
+    bam_plp_destroy (plp);
+    for (bam1_t *b : recs)
+        bam_destroy1 (b);
+
+    // outside the read, nothing
+    bam_pileup1_t p{};
+    bam1_t *b = bam_init1();
+    const uint32_t cigar[] = {op (4, BAM_CMATCH)};
+    bam_set1 (b, 1, "r", 0, 0, 10, 40, 1, cigar, -1, -1, 0, 4, "ACGT",
+              NULL, 0);
+    REQUIRE_FALSE (resolve_at (b, 9, p));
+    REQUIRE_FALSE (resolve_at (b, 14, p));
+    REQUIRE (resolve_at (b, 13, p));
+    REQUIRE (p.is_tail);
+    bam_destroy1 (b);
+}
+
+TEST_CASE ("point counts equal pileup counts") {
+    indexed_aln aln (synth_bam());
+    count_params cp = default_params();
+
+    // start at indels, where the CIGAR walk and the pileup could
+    // disagree, and at plain columns
+    hts_region contig = hts_region::by_end (0, 0, 70000);
+    std::vector<int> whole (contig.rlen * N_FIELDS_PER_OBS, 0);
+    count (aln.fh, aln.idx, AlleleEventCounter (cp, whole, AEVSettings{}),
+           contig, cp);
+    // from the position before each indel; one at 0 is covered by
+    // the start there
+    std::vector<int64_t> starts{0, 5000, 69990};
+    for (size_t r = 1; r < contig.rlen && starts.size() < 20; ++r) {
+        const int *row = whole.data() + r * N_FIELDS_PER_OBS;
+        int indels = 0;
+        for (size_t o : {size_t{0}, RSTRAND_OFFSET}) {
+            indels += row[o + FIELD_IS_DEL] + row[o + FIELD_FINS] +
+                row[o + FIELD_FDEL];
+        }
+        if (indels > 0)
+            starts.push_back (static_cast<int64_t> (r) - 1);
+    }
+    REQUIRE (starts.size() > 10);
+
+    count_params halved = cp;
+    halved.keep_below = keep_threshold (0.5);
+    count_params shallow = cp;
+    shallow.downsample_depth = 10;
+    for (bool overlaps : {false, true}) {
+        AEVSettings settings{overlaps};
+        for (const count_params &params : {cp, halved, shallow}) {
+            for (size_t rlen : {size_t{1}, POINT_QUERY_MAX_LEN}) {
+                for (int64_t start : starts) {
+                    start = std::max<int64_t> (
+                        0, std::min<int64_t> (
+                               start, contig.end -
+                                   static_cast<int64_t> (rlen)));
+                    auto reg = hts_region::by_len (0, start, rlen);
+                    CAPTURE (overlaps, params.keep_below,
+                             params.downsample_depth, rlen, start);
+                    count_params sampled =
+                        downsample_params (aln.fh, aln.idx, reg, params);
+                    std::vector<int> point (rlen * N_FIELDS_PER_OBS, 0),
+                        piled = point, counted = point;
+                    AlleleEventCounter pt (sampled, point, settings);
+                    REQUIRE (
+                        count_point (aln.fh, aln.idx, pt, reg, sampled));
+                    AlleleEventCounter pl (sampled, piled, settings);
+                    count_by_pileup (aln.fh, aln.idx, pl, reg, sampled);
+                    REQUIRE (point == piled);
+                    count (aln.fh, aln.idx,
+                           AlleleEventCounter (params, counted,
+                                               settings),
+                           reg, params);
+                    REQUIRE (counted == piled);
+                }
+            }
+        }
+    }
+
+    // a column that could reach max_depth falls back to the pileup,
+    // having counted nothing
+    count_params capped = cp;
+    capped.max_depth = 8;
+    for (bool overlaps : {false, true}) {
+        AEVSettings settings{overlaps};
+        auto reg = hts_region::by_len (0, 5000, POINT_QUERY_MAX_LEN);
+        std::vector<int> point (reg.rlen * N_FIELDS_PER_OBS, 0),
+            piled = point, counted = point;
+        AlleleEventCounter pt (capped, point, settings);
+        REQUIRE_FALSE (count_point (aln.fh, aln.idx, pt, reg, capped));
+        REQUIRE (std::all_of (point.begin(), point.end(),
+                              [] (int c) { return c == 0; }));
+        AlleleEventCounter pl (capped, piled, settings);
+        count_by_pileup (aln.fh, aln.idx, pl, reg, capped);
+        count (aln.fh, aln.idx,
+               AlleleEventCounter (capped, counted, settings), reg,
+               capped);
+        REQUIRE (counted == piled);
+    }
+
+    // CIGARs the walk could step through differently, and more reads
+    // to a name than a pair
+    auto op = [] (uint32_t len, int o) {
+        return len << BAM_CIGAR_SHIFT | static_cast<uint32_t> (o);
+    };
+    const uint16_t fwd = BAM_FPAIRED | BAM_FREAD1 | BAM_FMREVERSE;
+    const uint16_t rev = BAM_FPAIRED | BAM_FREAD2 | BAM_FREVERSE;
+    std::string zero_len = test_bam (
+        "pev_test_zero_len.bam",
+        {{"a", fwd, 10, {op (5, BAM_CMATCH)}},
+         {"b", fwd, 10,
+          {op (2, BAM_CMATCH), op (0, BAM_CINS), op (3, BAM_CMATCH)}}});
+    std::string three = test_bam ("pev_test_three_mates.bam",
+                                  {{"dup", fwd, 10, {op (5, BAM_CMATCH)}},
+                                   {"dup", rev, 10, {op (5, BAM_CMATCH)}},
+                                   {"dup", fwd, 11, {op (5, BAM_CMATCH)}},
+                                   {"p", fwd, 12, {op (5, BAM_CMATCH)}},
+                                   {"p", rev, 12, {op (5, BAM_CMATCH)}}});
+    auto reg = hts_region::by_len (0, 9, 8);
+    for (bool overlaps : {false, true}) {
+        AEVSettings settings{overlaps};
+        for (const std::string &path : {zero_len, three}) {
+            CAPTURE (overlaps, path);
+            indexed_aln t (path);
+            std::vector<int> point (reg.rlen * N_FIELDS_PER_OBS, 0),
+                piled = point, counted = point;
+            AlleleEventCounter pt (cp, point, settings);
+            bool walked = count_point (t.fh, t.idx, pt, reg, cp);
+            // three reads to a name only matter when pairing mates
+            REQUIRE (walked == (path == three && !overlaps));
+            AlleleEventCounter pl (cp, piled, settings);
+            count_by_pileup (t.fh, t.idx, pl, reg, cp);
+            if (walked)
+                REQUIRE (point == piled);
+            else
+                REQUIRE (std::all_of (point.begin(), point.end(),
+                                      [] (int c) { return c == 0; }));
+            count (t.fh, t.idx, AlleleEventCounter (cp, counted, settings),
+                   reg, cp);
+            REQUIRE (counted == piled);
+        }
+    }
+}
+
+TEST_CASE ("read tally") {
+    count_params cp{30, 25, 0, 1000000, 2, 1024};
+    const uint32_t cigar[] = {4 << BAM_CIGAR_SHIFT | BAM_CMATCH};
+    bam1_t *b = bam_init1();
+    read_tally t;
+    // each read counts against the first filter it fails
+    bam_set1 (b, 1, "r", BAM_FDUP, 0, 10, 40, 1, cigar, -1, -1, 0, 4,
+              "ACGT", NULL, 0);
+    tally_read (t, b, cp);
+    b->core.flag = BAM_FPAIRED;
+    tally_read (t, b, cp);
+    b->core.flag = BAM_FPROPER_PAIR;
+    b->core.qual = 10;
+    tally_read (t, b, cp);
+    b->core.qual = 40;
+    tally_read (t, b, cp);
+    bam_destroy1 (b);
+    REQUIRE (t.fetched == 4);
+    REQUIRE (t.rejected_exclude == 1);
+    REQUIRE (t.rejected_include == 1);
+    REQUIRE (t.rejected_mapq == 1);
+
+    run_stats rs;
+    rs.add (t);
+    rs.add (t);
+    REQUIRE (rs.reads_fetched == 8);
+    std::string json = run_stats_json (rs);
+    REQUIRE (json.find ("\"mapq\":2") != std::string::npos);
+    REQUIRE (json.find ("\"peak_rss_kib\":") != std::string::npos);
+}
+
+TEST_CASE ("batched column counting") {
+    // reads of every strand and mapq, with bases and qualities that
+    // cover each classification, paired with arbitrary pileup state
+    const char *seq = "ACGTNACGTNAC";
+    const char qual[] = {40, 10, 35, 30, 31, 0, 40, 40, 5, 33, 40, 29};
+    const uint32_t cigar[] = {12 << BAM_CIGAR_SHIFT | BAM_CMATCH};
+    ReadMetaCache cache;
+    std::vector<bam1_t *> reads;
+    std::vector<bam_pileup1_t> column;
+    uint32_t state = 12345;
+    auto next = [&state] (uint32_t n) {
+        state = state * 1103515245u + 12345u;
+        return (state >> 16) % n;
+    };
+    for (int r = 0; r < 8; ++r) {
+        bam1_t *b = bam_init1();
+        bam_set1 (b, 1, "r", r % 2 ? BAM_FREVERSE : 0, 0, 10,
+                  static_cast<uint8_t> (20 + r * 5), 1, cigar, -1, -1,
+                  0, 12, seq, qual, 0);
+        reads.push_back (b);
+    }
+    for (int i = 0; i < 500; ++i) {
+        bam_pileup1_t p{};
+        p.b = reads[next (8)];
+        p.qpos = static_cast<int32_t> (next (12));
+        p.indel = static_cast<int> (next (3)) - 1;
+        p.is_del = next (4) == 0;
+        p.is_head = next (5) == 0;
+        p.is_tail = next (5) == 0;
+        p.cd.p = cache.acquire (p.b);
+        column.push_back (p);
+    }
+
+    for (int clip : {0, 2}) {
+        count_params cp = default_params();
+        cp.clip_bound = clip;
+        std::vector<int> by_read (N_FIELDS_PER_OBS * 2, 0);
+        std::vector<int> batched (N_FIELDS_PER_OBS * 2, 0);
+        std::vector<int> generic (N_FIELDS_PER_OBS * 2, 0);
+        AlleleEventCounter a (cp, by_read, AEVSettings{});
+        AlleleEventCounter b (cp, batched, AEVSettings{});
+        AlleleEventCounter c (cp, generic, AEVSettings{});
+        for (size_t n : {size_t{0}, size_t{1}, size_t{7}, column.size()}) {
+            a._count_reads (column.data(), 1, n);
+            // the variant for clip, and the one testing positions
+            // regardless
+            b.count_pileup (column.data(), 1, n);
+            c._count_batch<true> (column.data(), 1, n);
+            CAPTURE (clip, n);
+            REQUIRE (by_read == batched);
+            REQUIRE (by_read == generic);
+        }
+    }
+
+    for (bam_pileup1_t &p : column)
+        cache.release (p.b, static_cast<ReadMeta *> (p.cd.p));
+    for (bam1_t *b : reads)
+        bam_destroy1 (b);
+}
+
+TEST_CASE ("bounds policy") {
+    REQUIRE (checked_bounds::size (5, "x", 5) == 5);
+    REQUIRE_THROWS_WITH (checked_bounds::size (-1, "offset"),
+                         "offset: size would be negative");
+    REQUIRE_THROWS (checked_bounds::size (16, "nt", 15));
+    // unchecked trusts its caller
+    REQUIRE (unchecked_bounds::size (16, "nt", 15) == 16);
+#ifdef PEV_CHECKED_BOUNDS
+    REQUIRE (hot_bounds::checked);
+#else
+    REQUIRE_FALSE (hot_bounds::checked);
+#endif
+
+    safe_size_opts sso;
+    sso.upper = 3;
+    sso.msg = "span";
+    REQUIRE_THROWS_WITH (safe_size (4, sso),
+                         "span: size would exceed upper bound");
+}
+
+TEST_CASE ("downsample by read name") {
+    REQUIRE (qname_hash ("read1", 7) == qname_hash ("read1", 7));
+    REQUIRE (qname_hash ("read1", 7) != qname_hash ("read1", 8));
+    REQUIRE (keep_threshold (1.0) == UINT64_MAX);
+    REQUIRE (keep_threshold (0.0) == 0);
+    REQUIRE (keep_threshold (0.5) == (UINT64_MAX >> 1) + 1);
+
+    count_params cp{30, 25, 0, 1000000, 2, 1024};
+    cp.keep_below = keep_threshold (0.25);
+    cp.downsample_seed = 3;
+    const uint32_t cigar[] = {4 << BAM_CIGAR_SHIFT | BAM_CMATCH};
+    bam1_t *b = bam_init1();
+    bam1_t *mate = bam_init1();
+    size_t kept = 0;
+    const size_t n = 4000;
+    for (size_t i = 0; i < n; ++i) {
+        std::string name = "tmpl" + std::to_string (i);
+        bam_set1 (b, name.size(), name.c_str(), BAM_FREAD1, 0, 10, 40,
+                  1, cigar, 0, 200, 194, 4, "ACGT", NULL, 0);
+        bam_set1 (mate, name.size(), name.c_str(), BAM_FREAD2, 0, 200,
+                  40, 1, cigar, 0, 10, -194, 4, "ACGT", NULL, 0);
+        // mates share a name, so a decision
+        REQUIRE (downsampled_out (b, cp) == downsampled_out (mate, cp));
+        kept += !downsampled_out (b, cp);
+    }
+    bam_destroy1 (b);
+    bam_destroy1 (mate);
+    REQUIRE (kept > n / 5);
+    REQUIRE (kept < n * 3 / 10);
+}
+
+TEST_CASE ("downsample depth resolved once") {
+    indexed_aln aln (synth_bam());
+    // short, so tried without a pileup, and too deep for that, so
+    // counted again with one
+    count_params cp = default_params();
+    cp.max_depth = 8;
+    cp.downsample_depth = 10;
+    run_stats rs;
+    cp.stats = &rs;
+    hts_region reg = hts_region::by_len (0, 5000, 10);
+
+    size_t n_records = 0;
+    hts_itr_t *iter =
+        sam_itr_queryi (aln.idx, reg.rid, reg.start, reg.end);
+    REQUIRE (iter != NULL);
+    bam1_t *b = bam_init1();
+    while (sam_itr_next (aln.fh, iter, b) >= 0)
+        ++n_records;
+    bam_destroy1 (b);
+    sam_itr_destroy (iter);
+
+    std::vector<int> counts (reg.rlen * N_FIELDS_PER_OBS, 0);
+    count (aln.fh, aln.idx,
+           AlleleEventCounter (cp, counts, AEVSettings{}), reg, cp);
+    REQUIRE (n_records > 10);
+    REQUIRE (rs.reads_depth_scanned == n_records);
+    REQUIRE (rs.rejected_downsample > 0);
+
+    // a merged query or site cluster would pick one fraction for all
+    // its regions or sites, so neither takes a depth
+    std::vector<hts_region> regs{reg, hts_region::by_len (0, 5005, 10)};
+    REQUIRE_THROWS_AS (count_planned (aln.fh, aln.idx, regs,
+                                      plan_regions (regs, 0), cp,
+                                      AEVSettings{},
+                                      [] (size_t, size_t, const int *,
+                                          size_t) {}),
+                       std::invalid_argument);
+    REQUIRE_THROWS_AS (count_sites (aln.fh, aln.idx,
+                                    {site{0, 5000, 5010}}, cp,
+                                    AEVSettings{},
+                                    [] (const int32_t *, const int64_t *,
+                                        const int *, size_t) {}),
+                       std::invalid_argument);
+}
+
+TEST_CASE ("result cache") {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "pev_test_cache";
+    fs::remove_all (dir);
+    auto aln = (fs::temp_directory_path() / "pev_test_cache.bam")
+                   .string();
+    std::ofstream (aln) << "not really a bam";
+
+    hts_region reg = hts_region::by_len (0, 100, 50);
+    count_params cp = default_params();
+    std::string key = cache_key (aln, reg, cp, AEVSettings{});
+    REQUIRE (!key.empty());
+    REQUIRE (cache_key ("no/such/file.bam", reg, cp, AEVSettings{})
+                 .empty());
+    // any parameter changes the key
+    REQUIRE (key != cache_key (aln, reg, cp, AEVSettings{true}));
+    cp.downsample_seed = 1;
+    REQUIRE (key != cache_key (aln, reg, cp, AEVSettings{}));
+    cp.downsample_seed = 0;
+
+    // mostly zero, as uncovered stretches are
+    std::vector<int> cells (reg.rlen * N_FIELDS_PER_OBS, 0);
+    cells[3] = 7;
+    cells[FIELD_MAPQ] = -3;
+    cells[500] = 1 << 30;
+    std::vector<int> got;
+    {
+        ResultCache cache (dir.string(), 1);
+        REQUIRE (!cache.load (key, cells.size(), got));
+        REQUIRE (cache.store (key, cells.data(), cells.size()));
+        REQUIRE (cache.load (key, cells.size(), got));
+        REQUIRE (got == cells);
+        REQUIRE (!cache.load (key, cells.size() + 1, got));
+    }
+    uintmax_t total = 0;
+    for (const auto &de : fs::directory_iterator (dir))
+        total += de.file_size();
+    REQUIRE (total < cells.size()); // under a byte a cell
+
+    // written as counted, in pieces splitting zero runs, and read
+    // back in blocks: the same entry as stored whole
+    {
+        ResultCache cache (dir.string(), 1);
+        std::string streamed = key + "streamed";
+        {
+            ResultCache::Writer w (cache, streamed, cells.size());
+            REQUIRE (w.ok());
+            for (size_t c = 0; c < cells.size(); c += 7)
+                w.put (cells.data() + c,
+                       std::min<size_t> (7, cells.size() - c));
+            REQUIRE (w.commit());
+        }
+        REQUIRE (cache.load (streamed, cells.size(), got));
+        REQUIRE (got == cells);
+        std::vector<int> replayed (cells.size(), -1);
+        size_t next = 0;
+        REQUIRE (cache.replay (streamed, cells.size(),
+                               [&] (size_t first, const int *block,
+                                    size_t n) {
+                                   REQUIRE (first == next);
+                                   REQUIRE (n <= 64);
+                                   std::copy_n (block, n,
+                                                replayed.begin() +
+                                                    static_cast<
+                                                        std::ptrdiff_t> (
+                                                        first));
+                                   next += n;
+                               },
+                               64));
+        REQUIRE (replayed == cells);
+
+        // short, uncommitted or over the bound, nothing is stored
+        std::string partial = key + "partial";
+        {
+            ResultCache::Writer w (cache, partial, cells.size());
+            w.put (cells.data(), cells.size() - 1);
+            REQUIRE_FALSE (w.commit());
+        }
+        {
+            ResultCache::Writer w (cache, partial, cells.size());
+            w.put (cells.data(), cells.size());
+        }
+        REQUIRE (!cache.load (partial, cells.size(), got));
+        {
+            std::vector<int> noisy (1 << 20, 1000);
+            ResultCache::Writer w (cache, partial, noisy.size());
+            w.put (noisy.data(), noisy.size());
+            REQUIRE_FALSE (w.ok());
+            REQUIRE_FALSE (w.commit());
+        }
+        REQUIRE (!cache.load (partial, 1 << 20, got));
+        size_t n_files = 0;
+        for (const auto &de : fs::directory_iterator (dir)) {
+            REQUIRE (de.path().extension() == CACHE_SUFFIX);
+            ++n_files;
+        }
+        REQUIRE (n_files == 2);
+    }
+
+    // entries beyond the bound are evicted, oldest first
+    {
+        ResultCache cache (dir.string(), 1);
+        std::vector<int> big (1 << 18);
+        for (size_t i = 0; i < big.size(); ++i)
+            big[i] = static_cast<int> (i % 1000) + 1;
+        std::string key2 = key + "2", key3 = key + "3";
+        REQUIRE (cache.store (key2, big.data(), big.size()));
+        REQUIRE (cache.store (key2 + "2", big.data(), big.size()));
+        REQUIRE (cache.store (key3, big.data(), big.size()));
+        REQUIRE (!cache.load (key2, big.size(), got));
+        REQUIRE (cache.load (key3, big.size(), got));
+    }
+    fs::remove_all (dir);
+    fs::remove (aln);
+}
+
+TEST_CASE ("merged regions in the binary matrix") {
+    indexed_aln aln (synth_bam());
+    count_params cp = default_params();
+    // unsorted, with overlaps, so plans reorder and interleave rows
+    std::vector<hts_region> regs = {
+        hts_region::by_len (0, 5000, 300),
+        hts_region::by_len (0, 1000, 200),
+        hts_region::by_len (0, 4900, 250),
+        hts_region::by_len (0, 1100, 50)};
+    std::vector<std::vector<int>> expected;
+    std::vector<matrix_region> mat_regions;
+    for (const hts_region &r : regs) {
+        expected.emplace_back (r.rlen * N_FIELDS_PER_OBS, 0);
+        count (aln.fh, aln.idx,
+               AlleleEventCounter (cp, expected.back(), {}), r, cp);
+        mat_regions.push_back (
+            {"r", "synth", r.start + 1, r.end});
+    }
+
+    // as main writes --regions --merge-gap: not dense, region and pos
+    // columns identifying each row
+    auto path = (std::filesystem::temp_directory_path() /
+                 "pev_test_merged.bin")
+                    .string();
+    std::string json = matrix_header_json (
+        {"region", "pos"}, mat_regions, cp, AEVSettings{}, false);
+    REQUIRE (json.find ("\"dense\":false") != std::string::npos);
+    REQUIRE (json.find ("row_offset") == std::string::npos);
+    {
+        MatrixWriter w (path, json);
+        count_planned (aln.fh, aln.idx, regs, plan_regions (regs, 100),
+                       cp, {},
+                       [&] (size_t ri, size_t first_row,
+                            const int *rows, size_t n_rows) {
+                           for (size_t r = 0; r < n_rows; ++r) {
+                               w.cell (uint64_t{ri});
+                               w.cell (static_cast<uint64_t> (
+                                   regs[ri].start) + first_row + r);
+                               w.counts (rows + r * N_FIELDS_PER_OBS);
+                           }
+                       });
+        w.close();
+    }
+
+    std::ifstream in (path, std::ios::binary);
+    std::string got ((std::istreambuf_iterator<char> (in)),
+                     std::istreambuf_iterator<char>());
+    std::filesystem::remove (path);
+    uint32_t hlen;
+    std::memcpy (&hlen, got.data() + 8, sizeof hlen);
+    std::vector<uint32_t> cells ((got.size() - 12 - hlen) /
+                                 sizeof (uint32_t));
+    std::memcpy (cells.data(), got.data() + 12 + hlen,
+                 cells.size() * sizeof (uint32_t));
+    const size_t n_cols = 2 + N_FIELDS_PER_OBS;
+    size_t total = 0;
+    for (const hts_region &r : regs)
+        total += r.rlen;
+    REQUIRE (cells.size() == total * n_cols);
+
+    // every row is found by its region and pos, though not in order
+    bool in_file_order = true;
+    size_t prev = 0;
+    for (size_t i = 0; i < total; ++i) {
+        const uint32_t *row = cells.data() + i * n_cols;
+        size_t ri = row[0];
+        in_file_order = in_file_order && ri >= prev;
+        prev = ri;
+        REQUIRE (ri < regs.size());
+        size_t off = row[1] - static_cast<size_t> (regs[ri].start);
+        for (size_t j = 0; j < N_FIELDS_PER_OBS; ++j) {
+            REQUIRE (static_cast<int> (row[2 + j]) ==
+                     expected[ri][off * N_FIELDS_PER_OBS + j]);
+        }
+    }
+    REQUIRE (!in_file_order);
+}
+
+TEST_CASE ("stream ordered") {
+    // items finish out of order but are consumed in order, with no
+    // more than ahead of them produced beyond the one consumed
+    std::vector<size_t> order;
+    std::atomic<size_t> in_flight{0};
+    std::atomic<size_t> most{0};
+    std::atomic<bool> bad_worker{false};
+    stream_ordered (
+        200, 4, 8,
+        [&] (size_t i, size_t worker, std::vector<int> &out) {
+            // no REQUIRE off the test thread
+            if (worker >= 4)
+                bad_worker = true;
+            size_t now = ++in_flight;
+            size_t seen = most;
+            while (now > seen && !most.compare_exchange_weak (seen, now))
+                ;
+            std::this_thread::sleep_for (
+                std::chrono::microseconds ((i * 37) % 11));
+            out.assign (i % 5 + 1, static_cast<int> (i));
+        },
+        [&] (size_t i, const std::vector<int> &out) {
+            REQUIRE (out.size() == i % 5 + 1);
+            REQUIRE (out[0] == static_cast<int> (i));
+            order.push_back (i);
+            --in_flight;
+        });
+    REQUIRE (order.size() == 200);
+    for (size_t i = 0; i < order.size(); ++i)
+        REQUIRE (order[i] == i);
+    REQUIRE (most <= 8);
+    REQUIRE (!bad_worker);
+
+    REQUIRE_THROWS_AS (
+        stream_ordered (
+            10, 3, 6,
+            [] (size_t i, size_t, std::vector<int> &out) {
+                if (i == 7)
+                    throw std::runtime_error ("item failed");
+                out.assign (1, 0);
+            },
+            [] (size_t, const std::vector<int> &) {}),
+        std::runtime_error);
+}
+
+TEST_CASE ("sharded counts equal serial counts") {
+    indexed_aln aln (synth_bam());
+    count_params cp = default_params();
+    // from the contig start, so shards begin amid reads and pairs
+    hts_region reg = hts_region::by_len (0, 0, 12345);
+
+    for (bool overlaps : {false, true}) {
+        AEVSettings settings{overlaps};
+        std::vector<int> serial (reg.rlen * N_FIELDS_PER_OBS, 0);
+        count (aln.fh, aln.idx,
+               AlleleEventCounter (cp, serial, settings), reg, cp);
+        for (size_t n_shards : {2, 7}) {
+            std::vector<int> sharded (serial.size(), 0);
+            count_sharded (synth_bam(), aln.idx, reg, cp, settings,
+                           sharded, n_shards);
+            REQUIRE (sharded == serial);
+
+            // through a window smaller than the region
+            std::vector<int> streamed (serial.size(), 0);
+            count_sharded_streaming (
+                synth_bam(), aln.idx, reg, cp, settings, n_shards,
+                [&] (size_t first_row, const int *rows, size_t n_rows) {
+                    REQUIRE (n_rows * 2 * n_shards <= 1000);
+                    std::copy_n (rows, n_rows * N_FIELDS_PER_OBS,
+                                 streamed.begin() +
+                                     static_cast<std::ptrdiff_t> (
+                                         first_row * N_FIELDS_PER_OBS));
+                },
+                {}, RowFilter::all, 1000);
+            REQUIRE (streamed == serial);
+        }
+    }
+}